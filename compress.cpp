@@ -1,16 +1,26 @@
 /**
  *  Entry point to the application.
- *  Compresses the given file using a canonicalized directed acyclic graph.
+ *  Compresses the given file using a canonicalized directed acyclic graph, or
+ *  decompresses such a graph back into FASTA.
  */
 
+#include <algorithm>
 #include <chrono>
 #include <filesystem>
+#include <fstream>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
 #include <vector>
 
 #include "shared_tree.h"
 #include "dna.h"
 #include "fasta_reader.h"
+#include "fasta_writer.h"
+#include "record_index.h"
+#include "size_tuner.h"
 
 void print_input(std::filesystem::path input_file, std::uintmax_t file_size) {
   std::cout
@@ -43,7 +53,24 @@ void print_output(std::filesystem::path output_file, std::filesystem::path histo
     std::cout << " Histogram:                 " << histogram << '\n';
 }
 
+void print_size_estimates(const std::vector<size_tuner::estimate>& estimates, std::size_t chosen,
+  std::size_t sampled)
+{
+  std::cout
+    << "\n============================================================\n"
+    << " DNA size estimates\n"
+    << "============================================================\n"
+    << " Sampled:                   " << bytes_to_string(sampled) << '\n';
+  for (const auto& estimate : estimates) {
+    std::cout << " Size " << estimate.dna_size << (estimate.dna_size < 10 ? " " : "")
+      << ":                  " << bytes_to_string(estimate.bytes) << ", " << estimate.time.count() << " ms\n";
+  }
+  std::cout << " Chosen DNA size:           " << chosen << '\n';
+}
+
 void print_tree_dimensions(shared_tree& tree, std::size_t width) {
+  auto records = std::size_t{0};
+  for (auto i = 0ul; i < tree.genome_count(); ++i) records += tree.genome(i).records().size();
   std::cout
     << "\n============================================================\n"
     << " Tree dimensions\n"
@@ -52,7 +79,9 @@ void print_tree_dimensions(shared_tree& tree, std::size_t width) {
     << " Width:                     " << width << '\n'
     << " Depth:                     " << tree.depth() << '\n'
     << " Leaves:                    " << tree.leaf_count() << '\n'
-    << " Nodes:                     " << tree.node_count() << '\n';
+    << " Nodes:                     " << tree.node_count() << '\n'
+    << " Genomes:                   " << tree.genome_count() << '\n'
+    << " Records:                   " << records << '\n';
 }
 
 void print_timings(std::chrono::milliseconds construction, std::chrono::milliseconds sorting) {
@@ -64,9 +93,45 @@ void print_timings(std::chrono::milliseconds construction, std::chrono::millisec
     << " Frequency sorting:         " << sorting.count() << " ms\n\n";
 }
 
+/**
+ * Returns the peak resident memory of the process in bytes since it was last
+ * reset, or 0 where this is not available.
+ */
+auto peak_memory() -> std::size_t {
+  auto status = std::ifstream{"/proc/self/status"};
+  for (auto line = std::string{}; std::getline(status, line);)
+    if (line.rfind("VmHWM:", 0) == 0) return std::stoull(line.substr(6)) * 1024;
+  return 0;
+}
+
+/**
+ * Resets the peak resident memory to the current resident memory, so that
+ * each phase can be measured separately.
+ */
+void reset_peak_memory() {
+  auto clear_refs = std::ofstream{"/proc/self/clear_refs"};
+  clear_refs << '5';
+}
+
+struct peak_memories {
+  std::size_t construction;
+  std::size_t sorting;
+  std::size_t saving;
+};
+
+void print_memory(const peak_memories& peaks) {
+  std::cout
+    << "============================================================\n"
+    << " Peak memory\n"
+    << "============================================================\n"
+    << " Tree construction:         " << bytes_to_string(peaks.construction) << '\n'
+    << " Frequency sorting:         " << bytes_to_string(peaks.sorting) << '\n'
+    << " Saving:                    " << bytes_to_string(peaks.saving) << "\n\n";
+}
+
 void print_statistics(std::size_t original_size, std::size_t compressed_size,
   std::size_t compressed_width, std::chrono::milliseconds construction,
-  std::chrono::milliseconds sorting)
+  std::chrono::milliseconds sorting, const peak_memories& peaks)
 {
   std::cout << dna::size()
     << ',' << compressed_width
@@ -76,30 +141,112 @@ void print_statistics(std::size_t original_size, std::size_t compressed_size,
     << ',' << construction.count()
     << ',' << sorting.count()
     << ',' << construction.count() + sorting.count()
+    << ',' << peaks.construction
+    << ',' << peaks.sorting
+    << ',' << peaks.saving
+    << '\n';
+}
+
+void print_decompression(std::size_t compressed_size, std::size_t nucleotides,
+  std::size_t output_size, std::chrono::milliseconds loading, std::chrono::milliseconds decoding)
+{
+  const auto seconds = std::max(decoding.count(), 1l)/1000.0;
+  std::cout
+    << "\n============================================================\n"
+    << " Decompression\n"
+    << "============================================================\n"
+    << " Compressed size:           " << bytes_to_string(compressed_size) << '\n'
+    << " Nucleotides:               " << nucleotides << '\n'
+    << " Output size:               " << bytes_to_string(output_size) << '\n'
+    << " Loading:                   " << loading.count() << " ms\n"
+    << " Decoding:                  " << decoding.count() << " ms\n"
+    << " Decode throughput:         " << bytes_to_string(output_size/seconds) << "/s\n\n";
+}
+
+void print_decompression_statistics(std::size_t compressed_size, std::size_t nucleotides,
+  std::size_t output_size, std::chrono::milliseconds loading, std::chrono::milliseconds decoding)
+{
+  const auto seconds = std::max(decoding.count(), 1l)/1000.0;
+  std::cout << dna::size()
+    << ',' << nucleotides
+    << ',' << compressed_size
+    << ',' << output_size
+    << ',' << loading.count()
+    << ',' << decoding.count()
+    << ',' << output_size/seconds/1e6
     << '\n';
 }
 
 void print_help() {
   std::cout
     << "Usage: compress [options] file...\n"
+    << "Multiple files are compressed into a single archive, with one genome per file.\n"
     << "Options:\n"
     << "\t--help\t\t\tPrints this documentation\n"
     << "\t--verbose\t\tPrint verbose output\n"
     << "\t--statistics\t\tPrint only numerical summary of output\n"
     << "\t--no-save\t\tDo not save the compressed file\n"
     << "\t--output=<file>\t\tWrite output to <file>, default being <input>.dag\n"
+    << "\t--mapped\t\tSave in the memory-mapped format, which loads in constant time\n"
+    << "\t--indexed\t\tSave in the compact format with an index for random access\n"
     << "\t--histogram=<file>\tSave histogram of node references in tree to <file>\n"
-    << "\t--dna-size=<size>\tThe number of nucleotides stored per leaf node, default is 12\n";
+    << "\t--spill=<file>\t\tSort out of core, spilling the tree to <file> until it is saved\n"
+    << "\t--append=<file>\t\tAppend the input files as new genomes to the archive <file>, which is\n"
+    << "\t\t\t\talso the default output, reducing only the new input\n"
+    << "\t--base=<file>\t\tStore only what the input adds to the base archive <file>, which is\n"
+    << "\t\t\t\talso required to decompress the output. Its index <file>.index,\n"
+    << "\t\t\t\tbuilt on first use, and a base saved with --mapped are shared\n"
+    << "\t\t\t\tbetween processes\n"
+    << "\t--dna-size=<size>\tThe number of nucleotides stored per leaf node, from 1 to 16,\n"
+    << "\t\t\t\tdefault is 12, or auto to choose it from the estimated size and\n"
+    << "\t\t\t\ttime on samples spread over all input files (decompression,\n"
+    << "\t\t\t\t--append and --base use the size stored in the file)\n"
+    << "\t--time-weight=<w>\tWith --dna-size=auto, minimise size * time^<w>, default is 0, which\n"
+    << "\t\t\t\tchooses the smallest output regardless of time\n"
+    << "\t--memory=<size>\t\tBudget in MiB for the hash-table payload bytes of the construction\n"
+    << "\t\t\t\tmaps, which are spilled to the temporary directory beyond it,\n"
+    << "\t\t\t\tdefault is unbounded\n"
+    << "\t--compact-maps\t\tCompact construction maps in memory once nearly all lookups are hits\n"
+    << "\t--threads=<count>\tThe number of threads used in tree construction, sorting and\n"
+    << "\t\t\t\t(de)serialization, default is 1\n"
+    << "\t--decompress\t\tDecompress a .dag file into FASTA, default output being <input>.fasta\n"
+    << "\t--line-width=<width>\tThe number of nucleotides per decompressed line, default is 80\n"
+    << "\t\t\t\t(0 writes the sequence on a single line)\n"
+    << "\t--header=<text>\t\tHeader line written before the decompressed sequence, instead of\n"
+    << "\t\t\t\tthe headers of the original records\n"
+    << "\t--region=<region>\tDecompress only the region <name>[:<begin>[-<end>]] of a record,\n"
+    << "\t\t\t\twith 1-based inclusive positions\n"
+    << "\t--genome=<index>\tDecompress only genome <index> of a multi-genome archive, counting\n"
+    << "\t\t\t\tfrom 0, to which --region then applies instead of to the first genome\n";
 }
 
-auto parse_commands(int argc, char* argv[]) {
+struct options {
   std::filesystem::path input_file;
+  std::vector<std::filesystem::path> input_files;
   std::filesystem::path output_file;
   std::filesystem::path histogram;
+  std::filesystem::path spill;
+  std::filesystem::path append;
+  std::filesystem::path base;
   bool verbose = false;
   bool statistics = false;
   bool save = true;
-  std::size_t dna_size = 12;
+  bool mapped = false;
+  bool indexed = false;
+  bool decompress = false;
+  std::optional<std::size_t> dna_size;  // Empty for the default size, zero for --dna-size=auto
+  double time_weight = 0;
+  std::size_t line_width = 80;
+  std::string header;
+  std::string region;
+  std::optional<std::size_t> genome;
+  unsigned threads = 1;
+  std::size_t memory = 0;
+  bool compact = false;
+};
+
+auto parse_commands(int argc, char* argv[]) {
+  auto result = options{};
 
   if (argc == 1) {
     std::cout << "Invalid command: argument <file> required.\n";
@@ -107,106 +254,421 @@ auto parse_commands(int argc, char* argv[]) {
     exit(2);
   }
 
-  for (auto i = 1u; i < argc; ++i) {
+  for (auto i = 1; i < argc; ++i) {
     auto argument = std::string_view{argv[i]};
 
     if (argument == "--help") {
       print_help();
       exit(0);
     } else if (argument == "--verbose") {
-      verbose = true;
+      result.verbose = true;
       continue;
     } else if (argument == "--statistics") {
-      statistics = true;
+      result.statistics = true;
       continue;
     } else if (argument.substr(0, 9) == "--output=") {
       argument.remove_prefix(9);
-      output_file = argument;
+      result.output_file = argument;
       continue;
     } else if (argument.substr(0, 12) == "--histogram=") {
       argument.remove_prefix(12);
-      histogram = argument;
+      result.histogram = argument;
+      continue;
+    } else if (argument.substr(0, 8) == "--spill=") {
+      argument.remove_prefix(8);
+      result.spill = argument;
+      continue;
+    } else if (argument.substr(0, 9) == "--append=") {
+      argument.remove_prefix(9);
+      result.append = argument;
+      continue;
+    } else if (argument.substr(0, 7) == "--base=") {
+      argument.remove_prefix(7);
+      result.base = argument;
+      continue;
+    } else if (argument == "--mapped") {
+      result.mapped = true;
+      continue;
+    } else if (argument == "--indexed") {
+      result.indexed = true;
       continue;
     } else if (argument == "--no-save") {
-      save = false;
+      result.save = false;
       continue;
     } else if (argument.substr(0, 11) == "--dna-size=") {
       argument.remove_prefix(11);
-      std::cout << argument << '\n';
-      dna_size = std::atoi(argument.data());
+      if (argument == "auto") {
+        result.dna_size = 0;
+        continue;
+      }
+      const auto size = std::atoi(argument.data());
+      if (size < 1 || std::size_t(size) > dna::max_size) {
+        std::cout << "Invalid DNA size: " << argument << ", expected 1 to " << dna::max_size << " or auto\n";
+        std::cout << "Use --help for more information\n";
+        exit(2);
+      }
+      result.dna_size = size;
+      continue;
+    } else if (argument.substr(0, 14) == "--time-weight=") {
+      argument.remove_prefix(14);
+      result.time_weight = std::max(std::strtod(argument.data(), nullptr), 0.0);
+      continue;
+    } else if (argument.substr(0, 10) == "--threads=") {
+      argument.remove_prefix(10);
+      result.threads = std::max(std::atoi(argument.data()), 1);
+      continue;
+    } else if (argument.substr(0, 9) == "--memory=") {
+      argument.remove_prefix(9);
+      result.memory = std::strtoull(argument.data(), nullptr, 10) << 20;
+      continue;
+    } else if (argument == "--compact-maps") {
+      result.compact = true;
+      continue;
+    } else if (argument == "--decompress") {
+      result.decompress = true;
+      continue;
+    } else if (argument.substr(0, 13) == "--line-width=") {
+      argument.remove_prefix(13);
+      result.line_width = std::max(std::atoi(argument.data()), 0);
+      continue;
+    } else if (argument.substr(0, 9) == "--header=") {
+      argument.remove_prefix(9);
+      result.header = argument;
+      continue;
+    } else if (argument.substr(0, 9) == "--region=") {
+      argument.remove_prefix(9);
+      result.region = argument;
+      continue;
+    } else if (argument.substr(0, 9) == "--genome=") {
+      argument.remove_prefix(9);
+      result.genome = std::strtoull(argument.data(), nullptr, 10);
       continue;
     } else { // Interpret as name of input file
-      if (!input_file.empty()) {
-        std::cout << "Compression of multiple files at once is currently not supported.\n";
-        exit(1);
-      }
-      input_file = argument;
+      if (result.input_file.empty()) result.input_file = argument;
+      result.input_files.emplace_back(argument);
     }
   }
 
-  if (verbose && statistics) {
+  if (result.verbose && result.statistics) {
     std::cout << "Invalid flag combination: --verbose and --statistics are mutually exclusive\n";
     std::cout << "Use --help for more information\n";
     exit(2);
   }
 
-  if (input_file.empty()) {
+  if (result.mapped && result.indexed) {
+    std::cout << "Invalid flag combination: --mapped and --indexed are mutually exclusive\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if (result.decompress && result.dna_size) {
+    std::cout << "Invalid flag combination: --dna-size is read from the file when decompressing\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if ((!result.region.empty() || result.genome) && !result.decompress) {
+    std::cout << "Invalid command: --region=<region> and --genome=<index> require --decompress\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if (result.input_files.size() > 1 && result.decompress) {
+    std::cout << "Invalid command: decompression takes a single file\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if (!result.append.empty() && result.decompress) {
+    std::cout << "Invalid flag combination: --append=<file> and --decompress are mutually exclusive\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if (result.dna_size == std::size_t{0} && (result.decompress || !result.append.empty() || !result.base.empty())) {
+    std::cout << "Invalid flag combination: --dna-size=auto only applies to new archives\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if (!result.base.empty() && !result.decompress
+      && (result.input_files.size() > 1 || !result.append.empty() || result.mapped || result.indexed
+        || !result.spill.empty() || !result.histogram.empty())) {
+    std::cout << "Invalid flag combination: --base=<file> takes a single input file, and excludes --append,\n"
+              << "--mapped, --indexed, --spill and --histogram\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if ((result.input_files.size() > 1 || !result.append.empty()) && (result.mapped || result.indexed)) {
+    std::cout << "Invalid flag combination: --mapped and --indexed do not support multiple genomes\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  if (result.input_file.empty()) {
     std::cout << "Invalid command: argument <file> required.\n";
     std::cout << "Use --help for more information\n";
     exit(2);
   }
 
-  if (output_file.empty() && save) {
-    output_file = input_file;
-    output_file.replace_extension(".dag");
+  if (result.output_file.empty() && result.save && !result.append.empty()) {
+    result.output_file = result.append;
+  } else if (result.output_file.empty() && result.save) {
+    result.output_file = result.input_file;
+    result.output_file.replace_extension(result.decompress ? ".fasta" : ".dag");
   }
 
-  return std::tuple{input_file, output_file, histogram, verbose, statistics, dna_size};
+  if (!result.spill.empty() && (result.spill == result.output_file || result.spill == result.input_file)) {
+    std::cout << "Invalid command: --spill=<file> must differ from the input and output files\n";
+    std::cout << "Use --help for more information\n";
+    exit(2);
+  }
+
+  return result;
 }
 
-int main(int argc, char* argv[]) {
-  auto [input_file, output_file, histogram, verbose, statistics, dna_size] = parse_commands(argc, argv);
-  dna::size(dna_size);
+/**
+ * Writes the nucleotides in [begin, end) of <tree> to <writer>, decoding them
+ * in blocks.
+ */
+void write_range(const shared_tree& tree, fasta_writer& writer, std::uint64_t begin, std::uint64_t end) {
+  constexpr auto block = std::uint64_t{1} << 20;
+  auto nucleotides = std::string(block, '\0');
+  for (; begin < end; begin += block) {
+    const auto written = tree.extract(begin, std::min(begin + block, end), nucleotides.data());
+    writer.write(std::string_view{nucleotides.data(), written});
+    if (written < std::min(block, end - begin)) break;
+  }
+}
+
+/**
+ * Decompresses a .dag file, streaming its leaves to FASTA output.
+ * Without an output file, the sequence is decoded but discarded. If the file
+ * holds a record index, each record is written with its own header, unless
+ * an explicit header is given. With a region, only that region is written.
+ * Multi-genome archives are written one genome after the other, or only the
+ * selected genome.
+ */
+int decompress(const options& options) {
+  const auto compressed_size = std::filesystem::file_size(options.input_file);
 
-  if (!std::filesystem::is_regular_file(input_file)) {
-    std::cout << "Invalid filename: " << input_file << '\n';
+  auto start = std::chrono::high_resolution_clock::now();
+  auto tree = shared_tree{};
+  try {
+    tree = shared_tree::load(options.input_file, options.threads);
+    if (tree.is_delta() && options.base.empty()) {
+      std::cout << "Invalid command: " << options.input_file << " was compressed against a base archive,\n"
+                << "which --base=<file> must give\n";
+      exit(2);
+    }
+    if (tree.is_delta())
+      tree = tree.rebase(std::make_shared<const shared_tree>(shared_tree::load(options.base, options.threads)));
+  } catch (const std::overflow_error& error) {
+    std::cerr << error.what() << ", aborting...\n";
+    exit(1);
+  }
+  auto end = std::chrono::high_resolution_clock::now();
+  auto loading_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+
+  const auto genomes = tree.genome_count();
+  if (options.genome && *options.genome >= genomes) {
+    std::cout << "Invalid genome: " << *options.genome << ", the archive holds " << genomes << " genome(s)\n";
     exit(2);
   }
+  const auto first = options.genome.value_or(0);
+  const auto last = (options.genome || !options.region.empty()) ? first + 1 : genomes;
+
+  auto region = std::optional<std::pair<std::uint64_t, std::uint64_t>>{};
+  if (!options.region.empty()) {
+    region = tree.genome(first).records().resolve(options.region);
+    if (!region) {
+      std::cout << "Unknown region: " << options.region << '\n';
+      exit(2);
+    }
+  }
+
+  auto file = std::ofstream{};
+  if (!options.output_file.empty()) {
+    file.open(options.output_file, std::ios::binary);
+    if (!file.is_open()) {
+      std::cout << "Unable to open output file: " << options.output_file << '\n';
+      exit(2);
+    }
+  }
+  auto discard = std::ostream{nullptr};
+  auto& output = options.output_file.empty() ? discard : static_cast<std::ostream&>(file);
+
+  start = std::chrono::high_resolution_clock::now();
+  auto writer = fasta_writer{output, options.line_width};
+  auto output_size = std::size_t{0};
+  auto add_record = [&](std::string_view header, std::size_t nucleotides) {
+    const auto line_breaks = options.line_width ? (nucleotides + options.line_width - 1)/options.line_width : 1;
+    output_size += nucleotides + line_breaks + (header.empty() ? 0 : header.size() + 2);
+  };
+
+  for (auto index = first; index < last; ++index) {
+    const auto genome = tree.genome(index);
+    const auto& records = genome.records();
+    if (region) {
+      const auto header = options.header.empty() ? options.region : options.header;
+      writer.header(header);
+      const auto before = writer.nucleotides();
+      write_range(genome, writer, region->first, region->second);
+      add_record(header, writer.nucleotides() - before);
+    } else if (!records.empty() && options.header.empty()) {
+      for (const auto& record : records) {
+        writer.header(record.header);
+        const auto before = writer.nucleotides();
+        write_range(genome, writer, record.start, record.end());
+        add_record(record.header, writer.nucleotides() - before);
+      }
+    } else {
+      auto header = options.header;
+      if (header.empty() && genomes > 1) header = "genome " + std::to_string(index);
+      if (!header.empty()) writer.header(header);
+      const auto before = writer.nucleotides();
+      genome.for_each_leaf(0, std::numeric_limits<std::uint64_t>::max(),
+        [&](const dna& strand) { writer.write(strand); });
+      add_record(header, writer.nucleotides() - before);
+    }
+  }
+  writer.close();
+  end = std::chrono::high_resolution_clock::now();
+  auto decoding_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
 
-  auto original_size = std::filesystem::file_size(input_file);
+  const auto nucleotides = writer.nucleotides();
+
+  if (options.verbose) {
+    if (!options.output_file.empty())
+      std::cout << "\n Filename:                  " << options.output_file << '\n';
+    print_decompression(compressed_size, nucleotides, output_size, loading_time, decoding_time);
+  }
 
-  if (verbose)
-    print_input(input_file, original_size);
+  if (options.statistics)
+    print_decompression_statistics(compressed_size, nucleotides, output_size, loading_time, decoding_time);
 
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  const auto options = parse_commands(argc, argv);
+
+  for (const auto& file : options.input_files) {
+    if (!std::filesystem::is_regular_file(file)) {
+      std::cout << "Invalid filename: " << file << '\n';
+      exit(2);
+    }
+  }
+  for (const auto& file : {options.append, options.base}) {
+    if (!file.empty() && !std::filesystem::is_regular_file(file)) {
+      std::cout << "Invalid filename: " << file << '\n';
+      exit(2);
+    }
+  }
 
+  if (options.decompress) {
+    dna::size(shared_tree::stored_dna_size(options.input_file));
+    return decompress(options);
+  }
+  if (!options.append.empty()) {
+    dna::size(options.dna_size.value_or(shared_tree::stored_dna_size(options.append)));
+  } else if (!options.base.empty()) {
+    dna::size(options.dna_size.value_or(shared_tree::stored_dna_size(options.base)));
+  } else if (options.dna_size == std::size_t{0}) {
+    // --dna-size=auto is resolved on samples of the input before any tree is
+    // built. The chosen size is stored in the archive.
+    const auto tuner = size_tuner{options.input_files};
+    const auto estimates = tuner.evaluate({4, 6, 8, 10, 12, 14, 16}, options.threads);
+    const auto chosen = size_tuner::choose(estimates, options.time_weight).dna_size;
+    if (!options.statistics)
+      print_size_estimates(estimates, chosen, tuner.sampled());
+    dna::size(chosen);
+  } else {
+    dna::size(options.dna_size.value_or(12));
+  }
+
+  auto original_size = std::uintmax_t{0};
+  for (const auto& file : options.input_files) {
+    const auto file_size = std::filesystem::file_size(file);
+    original_size += file_size;
+    if (options.verbose)
+      print_input(file, file_size);
+  }
+
+
+  auto peaks = peak_memories{};
+  reset_peak_memory();
   auto start = std::chrono::high_resolution_clock::now();
-  auto compressed = shared_tree{input_file, verbose};
+  auto compressed = shared_tree{};
+  auto reference = std::shared_ptr<const shared_tree>{};
+  try {
+    if (!options.base.empty()) {
+      reference = std::make_shared<const shared_tree>(shared_tree::load(options.base, options.threads));
+      const auto index = base_index{*reference, options.base, options.verbose};
+      compressed = shared_tree{options.input_file, index, options.verbose, options.threads, options.memory, options.compact};
+    } else if (!options.append.empty()) {
+      compressed = shared_tree::load(options.append, options.threads);
+      compressed.append(options.input_files, options.verbose, options.threads, options.memory, options.compact);
+    } else if (options.input_files.size() == 1) {
+      compressed = shared_tree{options.input_file, options.verbose, options.threads, options.memory, options.compact};
+    } else {
+      compressed = shared_tree{options.input_files, options.verbose, options.threads, options.memory, options.compact};
+    }
+  } catch (const std::overflow_error& error) {
+    std::cerr << error.what() << ", aborting...\n";
+    exit(1);
+  }
   auto end = std::chrono::high_resolution_clock::now();
   auto construction_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
-  
+  peaks.construction = peak_memory();
+
+  reset_peak_memory();
   start = std::chrono::high_resolution_clock::now();
-  compressed.sort_tree(verbose);
+  // Delta trees point into their base, of which the order is fixed, so they
+  // are left unsorted.
+  if (!compressed.is_delta() && options.spill.empty())
+    compressed.sort_tree(options.verbose, options.threads);
+  else if (!compressed.is_delta())
+    compressed.sort_on_disk(options.spill, options.verbose);
   end = std::chrono::high_resolution_clock::now();
   auto sorting_time = std::chrono::duration_cast<std::chrono::milliseconds>(end - start);
+  peaks.sorting = peak_memory();
 
   auto compressed_size = compressed.bytes();
-  auto compressed_width = compressed.width();
-
-
-  if (!histogram.empty())
-    compressed.store_histogram(histogram);
-
-  if (!output_file.empty())
-    compressed.save(output_file);
+  auto compressed_width = std::size_t{0};
+  if (compressed.is_delta() && (options.verbose || options.statistics))
+    compressed_width = compressed.rebase(reference).width();
+  for (auto i = 0ul; i < compressed.genome_count() && !compressed.is_delta(); ++i)
+    compressed_width += compressed.genome(i).width();
+
+
+  reset_peak_memory();
+  if (!options.histogram.empty())
+    compressed.store_histogram(options.histogram);
+
+  if (!options.output_file.empty()) {
+    if (options.mapped) compressed.save_mapped(options.output_file);
+    else if (options.indexed) compressed.save_indexed(options.output_file);
+    else compressed.save(options.output_file, options.threads);
+    compressed_size = std::filesystem::file_size(options.output_file);
+  }
+  peaks.saving = peak_memory();
 
-  if (verbose) {
-    print_output(output_file, histogram, compressed_size, compressed_width, original_size);
+  if (options.verbose) {
+    print_output(options.output_file, options.histogram, compressed_size, compressed_width, original_size);
     print_tree_dimensions(compressed, compressed_width);
     print_timings(construction_time, sorting_time);
+    print_memory(peaks);
+  }
+
+  if (options.statistics) {
+    print_statistics(original_size, compressed_size, compressed_width, construction_time, sorting_time, peaks);
   }
 
-  if (statistics) {
-    print_statistics(original_size, compressed_size, compressed_width, construction_time, sorting_time);
+  if (!options.spill.empty()) {
+    compressed = shared_tree{};
+    std::filesystem::remove(options.spill);
   }
 
   return 0;
@@ -31,6 +31,8 @@ enum class nac : char {
   N = 0b0110, Indeterminate = 0b1111
 };
 
+bool valid_nac(char code);
+
 /******************************************************************************
  * FASTA-compliant DNA strand
  *  Only Uracil is neglected, as it is not present in DNA; all other FASTA
@@ -42,7 +44,10 @@ public:
   dna(const std::string_view strand);
   dna(unsigned long long value) noexcept;
 
+  static auto parse(const char* strand, dna& result) noexcept -> bool;
+  static auto parse_padded(const char* strand, dna& result) noexcept -> bool;
   static auto random(unsigned seed = 0) -> dna;
+  static constexpr std::size_t max_size = 16;   // Nucleotides that fit in the 64 bits of a leaf
   static auto size() noexcept -> std::size_t { return length; }
   static auto size(std::size_t new_size) noexcept -> std::size_t { length = new_size; return length;}
 
@@ -51,6 +56,13 @@ public:
   auto inverted() const noexcept -> dna { return transposed().mirrored(); }
   auto invariant() const noexcept -> bool { return *this == mirrored(); }
   auto canonical() const noexcept -> std::tuple<dna, bool, bool, bool>;
+  static void canonical(const dna* strands, std::size_t count, dna* canonicals, std::uint8_t* transforms) noexcept;
+
+  // Bits describing the transformation to canonical form in batched
+  // canonicalisation, matching the booleans returned by canonical().
+  static constexpr std::uint8_t mirror_bit = 0b001;
+  static constexpr std::uint8_t transpose_bit = 0b010;
+  static constexpr std::uint8_t invariant_bit = 0b100;
 
   static auto bytes() noexcept -> std::size_t { return (size()+1)/2; }
   void serialize(std::ostream& os) const;
@@ -58,6 +70,7 @@ public:
 
   auto code(std::size_t index) const -> nac;
   auto nucleotide(std::size_t index) const -> char;
+  void to_chars(char* output) const noexcept;
   
   auto operator==(const dna& other) const noexcept -> bool { return nucleotides == other.nucleotides; }
   auto operator!=(const dna& other) const noexcept -> bool { return nucleotides != other.nucleotides; }
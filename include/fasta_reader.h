@@ -1,7 +1,11 @@
 /**
- *  Buffered file reader implementation for single-FASTA DNA sequences.
+ *  Buffered file reader implementation for FASTA DNA sequences.
  *  Allows one to read bigger DNA sequences without requiring them to be fully
  *  loaded in memory.
+ *  The file is memory-mapped, so that nucleotides are parsed straight from
+ *  the page cache into DNA strands, without intermediate copies.
+ *  All records are joined into a single strand; their headers and lengths are
+ *  gathered in a record index.
  */
 
 #pragma once
@@ -15,6 +19,7 @@
 #include <vector>
 
 #include "dna.h"
+#include "record_index.h"
 
 class fasta_reader {
 public:
@@ -23,10 +28,7 @@ public:
   fasta_reader(std::filesystem::path path, std::size_t buffer_size = (1<<22));
   fasta_reader(const fasta_reader&) = delete;
   fasta_reader(fasta_reader&&) = delete;
-
-  ~fasta_reader() {
-    if (background_loader.joinable()) background_loader.join();
-  }
+  ~fasta_reader();
 
   auto eof() const -> bool { return end_of_file; }
   void load_buffer();
@@ -34,13 +36,21 @@ public:
   auto read_into(std::vector<dna>& vector) -> bool;
   auto size() const -> std::size_t;
   auto buffers() const -> std::size_t;
+  auto records() const -> const record_index& { return index; }
 
 private:
+  void report_invalid_symbol(std::size_t position, bool start_of_line) const;
+
   std::vector<dna> buffer;
-  std::vector<char> char_buffer;
-  std::ifstream file;
+  std::size_t capacity;           // Number of strands per buffer
   std::filesystem::path path;
+  const char* data = nullptr;     // Memory-mapped file contents
+  std::size_t file_size = 0;
+  std::size_t offset = 0;         // Position of the next unparsed character
+  bool line_start = true;
   bool end_of_file = false;
+  std::uint64_t strands = 0;      // Number of strands parsed into earlier buffers
+  record_index index;             // Complete once the whole file has been read
   std::thread background_loader;
 };
 
@@ -0,0 +1,39 @@
+/**
+ *  Buffered file writer for single-FASTA DNA sequences.
+ *  Nucleotides are gathered in a large buffer, so that output is written in
+ *  a few big blocks rather than strand by strand.
+ */
+
+#pragma once
+
+#include <iostream>
+#include <string_view>
+#include <vector>
+
+#include "dna.h"
+
+class fasta_writer {
+public:
+  fasta_writer(std::ostream& os, std::size_t line_width = 80, std::size_t buffer_size = (1<<22));
+  fasta_writer(const fasta_writer&) = delete;
+  fasta_writer(fasta_writer&&) = delete;
+  ~fasta_writer() { close(); }
+
+  void header(std::string_view description);
+  void write(const dna& strand);
+  void write(std::string_view nucleotides);
+  void flush();
+  void close();
+
+  auto nucleotides() const noexcept { return written; }
+
+private:
+  void reserve(std::size_t characters);
+
+  std::ostream& os;
+  std::vector<char> buffer;
+  std::size_t used = 0;
+  std::size_t line_width;     // Zero denotes a single unbroken line
+  std::size_t column = 0;
+  std::size_t written = 0;
+};
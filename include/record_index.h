@@ -0,0 +1,53 @@
+/**
+ *  Index of the records of a multi-record FASTA file.
+ *  All records are joined into a single strand when compressed; the index
+ *  keeps their headers and lengths, so that a region such as "chr7:1000-2000"
+ *  can be resolved to coordinates in that strand, and records can be restored
+ *  on decompression. Lookups take logarithmic time in the number of records.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class record_index {
+public:
+  struct record {
+    std::string header;     // Header line, without the leading '>'
+    std::uint64_t start;    // Offset of the first nucleotide in the strand
+    std::uint64_t length;   // Number of nucleotides
+
+    auto name() const -> std::string_view;
+    auto end() const noexcept { return start + length; }
+    auto first_leaf() const noexcept -> std::uint64_t;
+  };
+
+  void add(std::string_view header, std::uint64_t start);
+  void finish(std::uint64_t end);
+
+  auto size() const noexcept { return records.size(); }
+  auto empty() const noexcept { return records.empty(); }
+  auto& operator[](std::size_t index) const noexcept { return records[index]; }
+  auto begin() const noexcept { return records.begin(); }
+  auto end() const noexcept { return records.end(); }
+
+  auto find(std::string_view name) const -> const record*;
+  auto locate(std::uint64_t position) const -> std::size_t;
+  auto resolve(std::string_view region) const -> std::optional<std::pair<std::uint64_t, std::uint64_t>>;
+
+  auto bytes() const noexcept -> std::size_t;
+  void serialize(std::ostream& os) const;
+  static auto deserialize(std::istream& is) -> record_index;
+
+private:
+  void sort_names();
+
+  std::vector<record> records;
+  std::vector<std::size_t> by_name;   // Record indices, sorted on name
+};
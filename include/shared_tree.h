@@ -7,13 +7,21 @@
 
 #pragma once
 
+#include <algorithm>
 #include <array>
 #include <cassert>
 #include <cstdint>
+#include <cstring>
 #include <deque>
 #include <filesystem>
+#include <functional>
 #include <iostream>
+#include <limits>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 #include "robin_hood.h"
@@ -32,50 +40,119 @@
  *  A third bit is stored to denote whether or not the node pointed to is
  *  invariant under mirroring. This bit is not stored to disk but only used
  *  during construction.
+ *  All of this is packed into a single 32-bit word: the index in the lower 29
+ *  bits, followed by the mirror, transpose and invariance bits. Building with
+ *  SHARED_TREE_WIDE_POINTERS defined widens this word to 64 bits, with 61 bits
+ *  of index, for layers of more than 2^29-1 distinct nodes.
  */
+#ifdef SHARED_TREE_WIDE_POINTERS
+using pointer_word = std::uint64_t;
+#else
+using pointer_word = std::uint32_t;
+#endif
+
 class pointer {
 public:
   static constexpr auto address_bits = std::array{4, 12, 20, 28};
 
   pointer(std::nullptr_t = nullptr) noexcept;
-  pointer(const pointer& other, bool mirror = false, bool transpose = false) noexcept;
+  pointer(const pointer& other, bool mirror, bool transpose) noexcept;
   pointer(std::size_t index, bool mirror, bool transpose, bool invariant) noexcept;
 
+  pointer(const pointer&) noexcept = default;
   pointer(pointer&&) noexcept = default;
   pointer& operator=(const pointer&) noexcept = default;
   pointer& operator=(pointer&&) noexcept = default;
 
   bool empty() const noexcept { return *this == nullptr; }
-  auto canonical() const noexcept { return data; }
+  auto canonical() const noexcept { return word & data_mask; }
   auto index() const noexcept -> std::size_t;
   auto leaf() const noexcept -> dna;
 
   bool operator==(const pointer& other) const noexcept { return to_ulong() == other.to_ulong(); }
   bool operator!=(const pointer& other) const noexcept { return to_ulong() != other.to_ulong(); }
   bool operator<(const pointer& other) const noexcept { return to_ulong() < other.to_ulong(); }
-  auto to_ulong() const noexcept -> unsigned long;
+  auto to_ulong() const noexcept -> unsigned long { return word & ~invariant_bit; }
   operator bool() const noexcept { return *this != nullptr; }
 
   auto bytes() const noexcept -> std::size_t;
   void serialize(std::ostream& os) const;
   static auto deserialize(std::istream& is) -> pointer;
 
-  bool is_mirrored() const noexcept { return mirror; }
-  bool is_transposed() const noexcept { return transpose; }
-  bool is_inverted() const noexcept { return mirror && transpose; }
-  bool is_invariant() const noexcept { return invariant; }
+  bool is_mirrored() const noexcept { return word & mirror_bit; }
+  bool is_transposed() const noexcept { return word & transpose_bit; }
+  bool is_inverted() const noexcept { return is_mirrored() && is_transposed(); }
+  bool is_invariant() const noexcept { return word & invariant_bit; }
 
   auto mirrored() const noexcept { return pointer{*this, true, false}; }
   auto transposed() const noexcept { return pointer{*this, false, true}; }
   auto inverted() const noexcept { return pointer{*this, true, true}; }
 
+  // Number of index bits, of which the all-ones index denotes null.
+  static constexpr auto data_bits = int(8*sizeof(pointer_word)) - 3;
+  static constexpr auto null_index = (pointer_word{1} << data_bits) - 1;
+
+  // Mask of the bits of a pointer that nodes compare and hash on, which
+  // leaves out the invariance bit.
+  static constexpr auto compared_bits = pointer_word(~pointer_word{0} >> 1);
+
 private:
-  std::uint32_t data : address_bits.back() + 1;
-  bool mirror : 1;
-  bool transpose : 1;
-  bool invariant : 1;
+  static constexpr auto data_mask = null_index;
+  static constexpr auto mirror_bit = pointer_word{1} << data_bits;
+  static constexpr auto transpose_bit = pointer_word{1} << (data_bits + 1);
+  static constexpr auto invariant_bit = pointer_word{1} << (data_bits + 2);
+
+  static constexpr auto make_word(std::size_t index, bool mirror, bool transpose, bool invariant) noexcept {
+    return pointer_word(index & data_mask) | (mirror ? mirror_bit : 0) | (transpose ? transpose_bit : 0)
+      | (invariant ? invariant_bit : 0);
+  }
+
+  pointer_word word;
 };
 
+static_assert(sizeof(pointer) == sizeof(pointer_word) && std::is_trivially_copyable_v<pointer>);
+
+/**
+ * Constructor from another pointer. Transformations can be applied to the
+ * pointer, if necessary.
+ * Note that a transposed nullptr must also be a nullptr, so that bits must
+ * be set in this special case. This is the only case where a pointer is
+ * invariant under transposition.
+ */
+inline pointer::pointer(const pointer& other, bool mirror, bool transpose) noexcept
+: word{make_word(other.canonical(),
+    mirror != other.is_mirrored() && !other.is_invariant(),
+    transpose != other.is_transposed() && other != nullptr,
+    other.is_invariant())} {}
+
+/**
+ * Constructor from an index with given similarity transforms.
+ */
+inline pointer::pointer(std::size_t index, bool mirror, bool transpose, bool invariant) noexcept
+: word{make_word(index, mirror && !invariant, transpose, invariant)} {}
+
+/**
+ * Constructs a null pointer, indicating an empty subtree.
+ * Null pointers have all data bits set and are of maximum pointer size. Due to
+ * their infrequent occurrence, this bigger size is not an issue, while it
+ * significantly simplifies the indexing code.
+ * Mirror and transpose are false for all null pointers and their
+ * transformations.
+ */
+inline pointer::pointer(std::nullptr_t) noexcept
+: word{make_word(data_mask, false, false, true)} {}
+
+/**
+ * Interprets the data as an index pointing to an inner node.
+ */
+inline auto pointer::index() const noexcept -> std::size_t {
+  assert(!empty());
+  return canonical();
+}
+
+auto pointer_capacity() noexcept -> std::uint64_t;
+void check_capacity(std::uint64_t size);
+
 inline auto& operator<<(std::ostream& os, const pointer& pointer) {
   if (pointer.empty()) return os << "empty";
   else return os << '(' << pointer.index() << ": " << pointer.is_mirrored()
@@ -105,12 +182,16 @@ public:
   node& operator=(const node&) noexcept = default;
   node& operator=(node&&) noexcept = default;
   
-  bool operator==(const node& other) const noexcept;
+  bool operator==(const node& other) const noexcept {
+    if constexpr (sizeof(pointer) == 4) return to_ulong() == other.to_ulong();
+    else return children == other.children;
+  }
   bool operator!=(const node& other) const noexcept { return !(*this == other); };
   bool operator<(const node& other) const noexcept { return children < other.children; }
 
   auto left() const noexcept { return children[0]; }
   auto right() const noexcept { return children[1]; }
+  auto to_ulong() const noexcept -> std::uint64_t;
 
   auto mirrored() const noexcept { return node{children[1].mirrored(), children[0].mirrored()}; }
   auto transposed() const noexcept { return node{children[0].transposed(), children[1].transposed()}; }
@@ -133,6 +214,23 @@ private:
   std::array<pointer, 2> children;
 };
 
+static_assert(sizeof(node) == 2*sizeof(pointer) && std::is_trivially_copyable_v<node>);
+
+/**
+ * Returns both pointers as a single word without their invariance bits, on
+ * which nodes are compared and hashed. With wide pointers, this instead mixes
+ * both words into one.
+ */
+inline auto node::to_ulong() const noexcept -> std::uint64_t {
+  if constexpr (sizeof(pointer) == 4) {
+    auto word = std::uint64_t{0};
+    std::memcpy(&word, children.data(), sizeof(word));
+    return word & (std::uint64_t{pointer::compared_bits} << 32 | pointer::compared_bits);
+  } else {
+    return children[0].to_ulong() * 0x9E3779B97F4A7C15ull ^ children[1].to_ulong();
+  }
+}
+
 inline auto& operator<<(std::ostream& os, const node& n) {
   return os << "node<" << n.left() << ", " << n.right() << '>';
 }
@@ -140,12 +238,65 @@ inline auto& operator<<(std::ostream& os, const node& n) {
 namespace std {
   template<> struct hash<node> {
     auto operator()(const node& n) const noexcept -> std::size_t {
-      auto hash = std::hash<pointer>();
-      return detail::hash(hash(n.left()), hash(n.right()));
+      return robin_hood::hash<std::uint64_t>()(n.to_ulong());
     }
   };
 }
 
+/******************************************************************************
+ * class mappable_vector:
+ *  Vector that either owns its elements, or refers to a read-only array inside
+ *  a memory-mapped file. Both are read in the same way; modifying a mapped
+ *  vector first copies its elements into memory.
+ */
+template<typename T>
+class mappable_vector {
+public:
+  mappable_vector() = default;
+  mappable_vector(std::vector<T> elements) : owned{std::move(elements)} {}
+
+  static auto mapped(const T* elements, std::size_t count) {
+    auto result = mappable_vector{};
+    result.view = elements;
+    result.count = count;
+    return result;
+  }
+
+  auto is_mapped() const noexcept { return view != nullptr; }
+  auto size() const noexcept { return view ? count : owned.size(); }
+  auto empty() const noexcept { return size() == 0; }
+  auto data() const noexcept -> const T* { return view ? view : owned.data(); }
+
+  auto& operator[](std::size_t index) const noexcept { return data()[index]; }
+  auto& back() const noexcept { return data()[size()-1]; }
+  auto begin() const noexcept { return data(); }
+  auto end() const noexcept { return data() + size(); }
+
+  auto& operator[](std::size_t index) { return elements()[index]; }
+  auto& back() { return elements().back(); }
+  auto begin() { return elements().begin(); }
+  auto end() { return elements().end(); }
+  void reserve(std::size_t capacity) { elements().reserve(capacity); }
+
+  template<typename... Args>
+  auto& emplace_back(Args&&... args) { return elements().emplace_back(std::forward<Args>(args)...); }
+
+  auto elements() -> std::vector<T>& {
+    if (view) {
+      owned.assign(view, view + count);
+      view = nullptr;
+    }
+    return owned;
+  }
+
+private:
+  std::vector<T> owned;
+  const T* view = nullptr;
+  std::size_t count = 0;
+};
+
+class base_index;
+
 /******************************************************************************
  * class shared_tree:
  *  Shared binary tree class that exploits structural properties of balanced
@@ -158,20 +309,42 @@ public:
   shared_tree(std::filesystem::path path)
   : shared_tree{fasta_reader{path}} {};
 
-  shared_tree(fasta_reader file, bool verbose = false);
-  shared_tree(std::vector<dna>& data, bool verbose = false);
+  shared_tree(fasta_reader file, bool verbose = false, unsigned threads = 1,
+              std::size_t memory = 0, bool compact = false);
+  shared_tree(std::vector<dna>& data, bool verbose = false, unsigned threads = 1,
+              std::size_t memory = 0, bool compact = false);
+  shared_tree(const std::vector<std::filesystem::path>& paths, bool verbose = false, unsigned threads = 1,
+              std::size_t memory = 0, bool compact = false);
+  shared_tree(fasta_reader file, const base_index& base, bool verbose = false, unsigned threads = 1,
+              std::size_t memory = 0, bool compact = false);
 
   auto depth() const { return nodes.size() + 1; }
-  auto width() const { assert(nodes.back().size() == 1); return children(nodes.size()-1, root); }
+  auto width() const { return children(nodes.size()-1, root); }
+  auto genome_count() const noexcept { return std::max<std::size_t>(genomes.size(), 1); }
+  auto genome(std::size_t index) const -> shared_tree;
+  auto is_delta() const noexcept { return !base_sizes.empty(); }
+  auto is_rebased() const noexcept { return base != nullptr; }
+  auto rebase(std::shared_ptr<const shared_tree> base) const -> shared_tree;
 
   auto children(std::size_t layer, pointer pointer) const -> std::size_t;
   auto node_count() const -> std::size_t;
   auto node_count(std::size_t layer) const { return nodes[layer].size(); }
   auto leaf_count() const noexcept { return leaves.size(); }
+  auto& records() const noexcept { return sequences; }
+  auto& records() noexcept { return sequences; }
 
   auto access_leaf(pointer pointer) const -> dna;
   auto access_node(std::size_t layer, pointer pointer) const -> node;
   auto operator[](std::uint64_t index) const -> dna;
+  auto access_batch(const std::vector<std::uint64_t>& indices) const -> std::vector<dna>;
+
+  template<typename Func>
+  auto for_each_leaf(std::uint64_t first, std::uint64_t last, Func&& func) const -> std::uint64_t;
+  auto for_each_block(std::uint64_t first, std::uint64_t last,
+                      const std::function<void(const dna*, std::size_t)>& func) const -> std::uint64_t;
+  auto extract_strands(std::uint64_t first, std::uint64_t last) const -> std::vector<dna>;
+  auto extract(std::uint64_t begin, std::uint64_t end, char* output) const -> std::size_t;
+  auto extract(std::uint64_t begin, std::uint64_t end) const -> std::string;
 
   void add_layer() { nodes.emplace_back(); }
   void emplace_node(std::size_t layer, node node);
@@ -180,17 +353,37 @@ public:
   auto histogram(std::size_t layer) const -> std::vector<std::size_t>;
   void store_histogram(std::filesystem::path) const;
 
+  void append(const std::vector<std::filesystem::path>& paths, bool verbose = false, unsigned threads = 1,
+              std::size_t memory = 0, bool compact = false);
+  void canonicalise();
   void rewire_nodes(std::size_t layer, const std::vector<std::size_t>& indices);
-  void sort_leaves();
-  void sort_nodes(std::size_t layer);
-  void sort_tree(bool verbose = false);
+  void sort_tree(bool verbose = false, unsigned threads = 1);
+  auto sort_on_disk(std::filesystem::path, bool verbose = false,
+                    std::size_t memory = std::size_t{1} << 26) -> std::size_t;
 
   auto bytes() const noexcept -> std::size_t;
-  void serialize(std::ostream& os) const;
-  static auto deserialize(std::istream& is) -> shared_tree;
-  void save(std::filesystem::path) const;
+  void serialize(std::ostream& os, unsigned threads = 1) const;
+  static auto deserialize(std::istream& is, unsigned threads = 1) -> shared_tree;
+  void save(std::filesystem::path, unsigned threads = 1) const;
+  static auto load(std::filesystem::path, unsigned threads = 1) -> shared_tree;
+  static auto stored_dna_size(std::filesystem::path) -> std::size_t;
+
+  // Version 2 escapes indices beyond the 28-bit segment, reusing an offset
+  // that was a plain index in version 1, which is therefore not read.
+  // Version 3 adds the records section, and still reads version 2.
+  static constexpr auto stream_version = std::uint32_t{3};
+
+  static constexpr auto mapped_version = std::uint32_t{2};
+  static constexpr auto indexed_version = std::uint32_t{3};
+  void save_mapped(std::filesystem::path) const;
+  void save_indexed(std::filesystem::path) const;
+  static auto map(std::filesystem::path) -> shared_tree;
+  auto is_mapped() const noexcept { return mapping != nullptr; }
 
   friend inline auto operator<<(std::ostream& os, const shared_tree& tree) -> std::ostream&;
+  friend class indexed_tree;
+  friend class tree_constructor;
+  friend class base_index;
 
   struct iterator {
     struct status {
@@ -218,9 +411,74 @@ public:
   auto end() { return iterator{*this, 0, nullptr}; }
 
 private:
-  std::vector<std::vector<node>> nodes;
-  std::vector<dna> leaves;
+  std::vector<mappable_vector<node>> nodes;
+  mappable_vector<dna> leaves;
+  record_index sequences;   // Records of the input, if read from FASTA
+  pointer root;
+  std::shared_ptr<const void> mapping;  // Keeps the mapped file alive
+
+  // Root and records of every genome of a multi-genome tree, of which the
+  // tree itself represents the first. Empty for single-genome trees.
+  struct genome_entry {
+    pointer root;
+    record_index records;
+  };
+  std::vector<genome_entry> genomes;
+
+  auto genome_records() const -> std::vector<const record_index*>;
+
+  // Number of leaves and of nodes in each layer of the base that a delta tree
+  // refers into. Pointers of a delta tree address the elements of the base
+  // first, followed by its own. Empty for self-contained trees.
+  std::vector<std::uint64_t> base_sizes;
+  std::shared_ptr<const shared_tree> base;  // Base of a rebased delta tree, see rebase()
+
+  auto leaf_at(std::size_t index) const -> const dna&;
+  auto node_at(std::size_t layer, std::size_t index) const -> const node&;
+};
+
+/******************************************************************************
+ * class indexed_tree:
+ *  Read-only view of a shared tree stored in the indexed DAG format: the
+ *  compact serialized form, extended with the byte offset of every
+ *  <sample_rate>-th node in each layer. Nodes are decoded from the mapped file
+ *  on access, so that random access needs neither a full decode nor an
+ *  in-memory copy of the layers.
+ */
+class indexed_tree {
+public:
+  static constexpr auto sample_rate = std::size_t{64};
+
+  indexed_tree(std::filesystem::path path);
+
+  auto depth() const { return layers.size() + 1; }
+  auto width() const { return children(layers.size()-1, root); }
+  auto node_count(std::size_t layer) const { return layers[layer].count; }
+  auto leaf_count() const noexcept { return leaf_total; }
+
+  auto access_leaf(pointer pointer) const -> dna;
+  auto access_node(std::size_t layer, pointer pointer) const -> node;
+  auto children(std::size_t layer, pointer pointer) const -> std::size_t;
+  auto operator[](std::uint64_t index) const -> dna;
+
+  auto& records() const noexcept { return sequences; }
+  auto expand() const -> shared_tree;
+
+private:
+  struct encoded_layer {
+    const std::uint64_t* samples;
+    const unsigned char* stream;
+    std::size_t count;
+  };
+
+  auto leaf(std::size_t index) const noexcept -> dna;
+
+  std::shared_ptr<const void> mapping;
+  std::vector<encoded_layer> layers;
+  const unsigned char* leaves = nullptr;
+  std::size_t leaf_total = 0;
   pointer root;
+  record_index sequences;
 };
 
 inline auto operator<<(std::ostream& os, const shared_tree& tree) -> std::ostream& {
@@ -237,6 +495,407 @@ inline auto operator<<(std::ostream& os, const shared_tree& tree) -> std::ostrea
 }
 
 
+/**
+ * Applies <func> to each leaf in the range [first, last), in order.
+ * Stops early at the end of the tree. Returns the number of leaves visited.
+ */
+template<typename Func>
+auto shared_tree::for_each_leaf(std::uint64_t first, std::uint64_t last, Func&& func) const -> std::uint64_t {
+  return for_each_block(first, last, [&](const dna* block, std::size_t count) {
+    for (auto i = 0ul; i < count; ++i) func(block[i]);
+  });
+}
+
+
+/******************************************************************************
+ * class spill_file:
+ *  Temporary file to which data is appended, and which is mapped read-only
+ *  once complete. It is created in the temporary directory and unlinked right
+ *  away, so that it disappears once it is closed and unmapped.
+ */
+class spill_file {
+public:
+  spill_file();
+  spill_file(const spill_file&) = delete;
+  spill_file& operator=(const spill_file&) = delete;
+  ~spill_file();
+
+  void write(const void* data, std::size_t bytes);
+  auto map() -> std::shared_ptr<const void>;
+
+private:
+  int descriptor;
+  std::size_t size = 0;
+};
+
+
+/******************************************************************************
+ * class striped_map:
+ *  Parallel flat hash map of which each submap is guarded by its own mutex, so
+ *  that many threads can deduplicate into the same layer at once.
+ *  find_or_insert does not lock, so that sequential construction does not pay
+ *  for synchronisation. Concurrent insertion assigns indices lazily: keys are
+ *  first claimed with their position in the input, after which the earliest
+ *  claim of every new key is given its final index.
+ *  To bound its memory, the map can spill its entries to disk as a run sorted
+ *  on hash, after which it is empty again. Once nearly all lookups are hits,
+ *  it can likewise be compacted into such a run in memory, which takes less
+ *  space than the hash map. Keys in runs are still found, through an index of
+ *  hash buckets into each run.
+ */
+template<typename T>
+class striped_map {
+public:
+  static constexpr auto pending = std::size_t{1} << 63;
+  static constexpr auto is_pending(std::size_t value) noexcept { return (value & pending) != 0; }
+
+  struct spilled_entry {
+    T key;
+    std::size_t index;
+  };
+
+  auto claim(const T& key, std::size_t position) -> std::size_t;
+  auto lookup(const T& key) -> std::size_t;
+  void publish(const T& key, std::size_t index);
+
+  auto find_or_insert(const T& key, std::size_t index) -> std::pair<std::size_t, bool>;
+  void record(std::size_t new_lookups, std::size_t new_hits) noexcept;
+  auto lookup_count() const noexcept { return lookups; }
+  auto hit_count() const noexcept { return hits; }
+  auto is_saturated() -> bool;
+
+  auto payload_bytes() const noexcept -> std::size_t;
+  auto resident() const noexcept -> std::size_t;
+  void spill() { add_run(true); }
+  void compact() { add_run(false); }
+  void attach(std::shared_ptr<const void> storage, const spilled_entry* entries, std::size_t count);
+  void release();
+
+private:
+  using map_type = phmap::parallel_flat_hash_map<T, std::size_t,
+    phmap::container_internal::hash_default_hash<T>,
+    phmap::container_internal::hash_default_eq<T>,
+    phmap::container_internal::Allocator<phmap::container_internal::Pair<const T, std::size_t>>,
+    6>;
+
+  struct run {
+    std::shared_ptr<const void> storage;
+    const spilled_entry* entries;
+    std::size_t count;
+    bool on_disk;
+    std::vector<std::size_t> buckets;  // First entry of each bucket, followed by the count
+    unsigned shift;
+  };
+
+  static constexpr auto absent = std::numeric_limits<std::size_t>::max();
+  static constexpr auto order(std::size_t hash) noexcept { return hash * 0x9E3779B97F4A7C15ull; }
+  auto find_spilled(const T& key) const -> std::size_t;
+  void add_run(bool on_disk);
+  auto stripe(const T& key) -> std::mutex& { return stripes[map.subidx(map.hash(key))]; }
+
+  map_type map;
+  std::array<std::mutex, 1 << 6> stripes;
+  std::vector<run> runs;
+  std::vector<run> shared_runs;  // Read-only runs sorted on key, see attach()
+  std::size_t lookups = 0;
+  std::size_t hits = 0;
+  std::size_t checked_lookups = 0;
+  std::size_t checked_hits = 0;
+};
+
+/**
+ * Claims <key> for the element at <position> in the input, unless an earlier
+ * element already did so. Returns the value stored for the key afterwards:
+ * either its final index, or the pending position of its earliest claim.
+ */
+template<typename T>
+auto striped_map<T>::claim(const T& key, std::size_t position) -> std::size_t {
+  if (const auto index = find_spilled(key); index != absent) return index;
+  const auto claimed = pending | position;
+  auto lock = std::lock_guard{stripe(key)};
+  auto& value = map.emplace(key, claimed).first->second;
+  if (is_pending(value) && claimed < value) value = claimed;
+  return value;
+}
+
+/**
+ * Returns the value currently stored for <key>, which must be present.
+ */
+template<typename T>
+auto striped_map<T>::lookup(const T& key) -> std::size_t {
+  auto lock = std::lock_guard{stripe(key)};
+  return map.find(key)->second;
+}
+
+/**
+ * Replaces the pending claim of <key> by its final index.
+ */
+template<typename T>
+void striped_map<T>::publish(const T& key, std::size_t index) {
+  auto lock = std::lock_guard{stripe(key)};
+  map.find(key)->second = index;
+}
+
+/**
+ * Returns the index stored for <key> and false if it is present, and otherwise
+ * inserts it with <index> and returns that and true. Does not lock.
+ */
+template<typename T>
+auto striped_map<T>::find_or_insert(const T& key, std::size_t index) -> std::pair<std::size_t, bool> {
+  ++lookups;
+  if (!runs.empty() || !shared_runs.empty()) {
+    const auto entry = map.find(key);
+    const auto found = (entry != map.end()) ? entry->second : find_spilled(key);
+    if (found != absent) {
+      ++hits;
+      return {found, false};
+    }
+  }
+  const auto insertion = map.emplace(key, index);
+  hits += !insertion.second;
+  return {insertion.first->second, insertion.second};
+}
+
+/**
+ * Records lookups made through the concurrent interface, of which <new_hits>
+ * found a key that was already present before.
+ */
+template<typename T>
+void striped_map<T>::record(std::size_t new_lookups, std::size_t new_hits) noexcept {
+  lookups += new_lookups;
+  hits += new_hits;
+}
+
+/**
+ * Returns whether at least 99% of the lookups since the previous check were
+ * hits, so that the map hardly grows any more, and whether enough entries are
+ * in the hash map to be worth compacting. Lookups are only checked once there
+ * are enough of them to go by.
+ */
+template<typename T>
+auto striped_map<T>::is_saturated() -> bool {
+  constexpr auto minimum_lookups = std::size_t{1} << 16;
+  constexpr auto minimum_size = std::size_t{1} << 12;
+
+  const auto window = lookups - checked_lookups;
+  if (window < minimum_lookups) return false;
+  const auto window_hits = hits - checked_hits;
+  checked_lookups = lookups;
+  checked_hits = hits;
+  return window_hits >= window - window/100 && map.size() >= minimum_size;
+}
+
+/**
+ * Returns the payload bytes held in memory: the slots and control bytes of the
+ * hash table at its current capacity, and the entries and bucket indices of
+ * the compacted runs. This is what the memory budget of construction counts;
+ * allocator overhead and the metadata of the submaps are left out.
+ */
+template<typename T>
+auto striped_map<T>::payload_bytes() const noexcept -> std::size_t {
+  auto bytes = map.capacity() * (sizeof(typename map_type::value_type) + 1);
+  for (const auto& run : runs) {
+    bytes += run.buckets.size()*sizeof(std::size_t);
+    if (!run.on_disk) bytes += run.count*sizeof(spilled_entry);
+  }
+  return bytes;
+}
+
+/**
+ * Returns the number of entries held in memory, which spilling moves to disk.
+ */
+template<typename T>
+auto striped_map<T>::resident() const noexcept -> std::size_t {
+  auto count = map.size();
+  for (const auto& run : runs)
+    if (!run.on_disk) count += run.count;
+  return count;
+}
+
+/**
+ * Returns the index of <key> in the runs, or <absent> if it is in none.
+ * The oldest runs are searched first, since they are the largest. Shared runs
+ * are searched last, by binary search on the key.
+ */
+template<typename T>
+auto striped_map<T>::find_spilled(const T& key) const -> std::size_t {
+  if (runs.empty() && shared_runs.empty()) return absent;
+  const auto hashed = order(map.hash_function()(key));
+  for (const auto& run : runs) {
+    const auto bucket = hashed >> run.shift;
+    const auto end = run.entries + run.buckets[bucket+1];
+    for (auto entry = run.entries + run.buckets[bucket]; entry != end; ++entry)
+      if (entry->key == key) return entry->index;
+  }
+  for (const auto& run : shared_runs) {
+    const auto end = run.entries + run.count;
+    const auto entry = std::lower_bound(run.entries, end, key,
+      [](const spilled_entry& entry, const T& key) { return entry.key < key; });
+    if (entry != end && entry->key == key) return entry->index;
+  }
+  return absent;
+}
+
+/**
+ * Adds the <count> entries at <entries>, sorted on key, as a read-only run
+ * that <storage> keeps alive. Such runs are not merged, spilled or counted as
+ * payload, so that a mapped run can be shared with other processes.
+ */
+template<typename T>
+void striped_map<T>::attach(std::shared_ptr<const void> storage, const spilled_entry* entries, std::size_t count) {
+  shared_runs.push_back(run{std::move(storage), entries, count, true, {}, 0});
+}
+
+/**
+ * Moves all entries of the hash map to a new run sorted on hash, either on
+ * disk or in memory, and frees the memory they took. Runs are merged into it
+ * to keep their number logarithmic in the number of entries: runs in memory
+ * of at most its size, and when spilling to disk, also all runs in memory.
+ * Precondition: no claims are pending
+ */
+template<typename T>
+void striped_map<T>::add_run(bool on_disk) {
+  if (resident() == 0 || (!on_disk && map.empty())) return;
+
+  auto ordered = std::vector<std::pair<std::size_t, spilled_entry>>{};
+  ordered.reserve(map.size());
+  for (const auto& [key, index] : map) {
+    assert(!is_pending(index));
+    ordered.emplace_back(order(map.hash_function()(key)), spilled_entry{key, index});
+  }
+  map.clear();
+  std::sort(ordered.begin(), ordered.end(),
+    [](const auto& a, const auto& b) { return a.first < b.first; });
+  auto entries = std::vector<spilled_entry>{};
+  entries.reserve(ordered.size());
+  for (const auto& [hashed, entry] : ordered) entries.push_back(entry);
+  ordered = {};
+
+  // Selects the runs merged into the new one, which are removed from the list.
+  auto count = entries.size();
+  auto merged = std::vector<run>{};
+  auto take = [&](auto position) {
+    count += position->count;
+    merged.push_back(std::move(*position));
+    return runs.erase(position);
+  };
+  if (on_disk) {
+    for (auto position = runs.begin(); position != runs.end();)
+      position = position->on_disk ? std::next(position) : take(position);
+  }
+  while (!runs.empty() && runs.back().on_disk == on_disk && runs.back().count <= count)
+    take(std::prev(runs.end()));
+
+  struct source {
+    const spilled_entry* next;
+    const spilled_entry* end;
+    std::size_t hashed;
+  };
+  auto sources = std::vector<source>{};
+  auto advance = [&](source& source) {
+    if (source.next != source.end) source.hashed = order(map.hash_function()(source.next->key));
+  };
+  sources.push_back(source{entries.data(), entries.data() + entries.size(), 0});
+  for (const auto& run : merged)
+    sources.push_back(source{run.entries, run.entries + run.count, 0});
+  for (auto& source : sources) advance(source);
+
+  auto result = run{nullptr, nullptr, count, on_disk, {}, 63};
+  auto bucket_count = std::size_t{2};
+  while (bucket_count < count/8) bucket_count *= 2, --result.shift;
+  result.buckets.assign(bucket_count + 1, 0);
+
+  // Merges the sources, taking the smallest head each time, into either a
+  // buffer that is written to disk, or the final array in memory.
+  constexpr auto buffer_size = std::size_t{1} << 14;
+  auto file = std::optional<spill_file>{};
+  auto output = std::vector<spilled_entry>{};
+  if (on_disk) file.emplace(), output.reserve(buffer_size);
+  else output.reserve(count);
+
+  for (auto remaining = count; remaining > 0; --remaining) {
+    auto smallest = &sources.front();
+    for (auto& source : sources)
+      if (source.next != source.end && (smallest->next == smallest->end || source.hashed < smallest->hashed))
+        smallest = &source;
+    ++result.buckets[(smallest->hashed >> result.shift) + 1];
+    output.push_back(*smallest->next++);
+    advance(*smallest);
+    if (on_disk && (output.size() == buffer_size || remaining == 1)) {
+      file->write(output.data(), output.size()*sizeof(spilled_entry));
+      output.clear();
+    }
+  }
+  for (auto bucket = 0ul; bucket < bucket_count; ++bucket)
+    result.buckets[bucket+1] += result.buckets[bucket];
+
+  if (on_disk) {
+    result.storage = file->map();
+  } else {
+    auto owned = std::make_shared<std::vector<spilled_entry>>(std::move(output));
+    result.storage = std::shared_ptr<const void>{owned, owned->data()};
+  }
+  result.entries = static_cast<const spilled_entry*>(result.storage.get());
+  runs.push_back(std::move(result));
+}
+
+/**
+ * Frees all entries, both in memory and spilled, and detaches the shared runs.
+ */
+template<typename T>
+void striped_map<T>::release() {
+  map.clear();
+  runs.clear();
+  shared_runs.clear();
+}
+
+
+/******************************************************************************
+ * class base_index:
+ *  Index of the leaves and nodes of a base archive, against which delta trees
+ *  are built. For the leaves and each layer of nodes, it holds a run of their
+ *  canonical forms sorted on key, i.e. on their canonical children, with the
+ *  index of each element in the base. Since the base may have been sorted
+ *  after its construction, it also holds the transformations that
+ *  canonicalise each node as stored. The index is persisted next to the base
+ *  and mapped, so that processes compressing against the same base share its
+ *  pages instead of each rebuilding the construction maps. Where the
+ *  memory-mapped layout is not supported, or the index cannot be written, the
+ *  runs are held in memory instead.
+ */
+class base_index {
+public:
+  explicit base_index(const shared_tree& base);
+  base_index(const shared_tree& base, std::filesystem::path archive, bool verbose = false);
+
+  static auto path(std::filesystem::path archive) -> std::filesystem::path { return archive += ".index"; }
+  auto& tree() const noexcept { return base; }
+  auto is_mapped() const noexcept { return mapped; }
+
+  static constexpr auto version = std::uint32_t{1};
+
+private:
+  friend class tree_constructor;
+
+  template<typename T>
+  struct run {
+    const typename striped_map<T>::spilled_entry* entries;
+    std::size_t count;
+    const std::uint8_t* transforms;  // Transformations of each node, empty for the leaves
+  };
+
+  void build(bool verbose);
+  auto persist(std::filesystem::path archive) const -> bool;
+  auto load(std::filesystem::path archive) -> bool;
+
+  const shared_tree& base;
+  std::shared_ptr<const void> storage;  // Mapped file, or the runs if held in memory
+  run<dna> leaves = {};
+  std::vector<run<node>> nodes;
+  bool mapped = false;
+};
+
+
 /******************************************************************************
  * class tree_constructor:
  *  Helper class in construction of a balanced shared tree.
@@ -245,34 +904,68 @@ inline auto operator<<(std::ostream& os, const shared_tree& tree) -> std::ostrea
 class tree_constructor {
 public:
   // Parallel flat hash map offers better performance guarantees than robin hood.
-  // In addition, it has concurrency capabilities that might be useful later.
+  // In addition, its submaps can be locked separately, allowing concurrent
+  // construction.
   template<typename T>
-  using hash_map = phmap::parallel_flat_hash_map<T, std::size_t>;
+  using hash_map = striped_map<T>;
   // template<typename T>
   // using hash_map = robin_hood::unordered_flat_map<T, std::size_t>;
 
-  tree_constructor(shared_tree& parent);
+  tree_constructor(shared_tree& parent, unsigned threads = 1, std::size_t memory = 0, bool compact = false);
 
   auto emplace_node(std::size_t layer_index, pointer left, pointer right = nullptr) -> pointer;
   auto emplace_leaves(dna left, dna right) -> pointer;
   auto emplace_leaves(dna last) -> pointer;
   auto emplace_leaf(dna leaf) -> pointer;
+  auto emplace_canonical_leaf(dna canonical, std::uint8_t transforms) -> pointer;
 
   template<typename Iterable>
   auto reduce_leaves(Iterable&& layer) -> std::vector<pointer>;
   auto reduce_nodes(const std::vector<pointer>& segment, std::size_t index) -> std::vector<pointer>;
-  auto reduce_roots(bool verbose = false) -> pointer;
-  auto reduce(const std::vector<dna>& data, bool verbose = false) -> pointer;
-  auto reduce(fasta_reader& file, bool verbose = false) -> pointer;
+  auto reduce_roots(bool verbose = false, bool release = true) -> pointer;
+  auto reduce(const std::vector<dna>& data, bool verbose = false, bool release = true) -> pointer;
+  auto reduce(fasta_reader& file, bool verbose = false, bool release = true) -> pointer;
+  auto raise(pointer root, std::size_t layer) -> pointer;
+  void index_tree(bool verbose = false);
+  void index_base(const base_index& base);
+  auto root_layer() const noexcept { return top; }
+  void manage_maps();
+  void print_hit_rates() const;
 
   template<typename Iterable>
   void reduce_segment(Iterable&& layer);
+  template<typename Segment>
+  void reduce_segments(const std::vector<Segment>& segments);
 
 private:
+  auto next_leaf() const { return base_leaves + parent.leaf_count(); }
+  auto next_node(std::size_t layer) const {
+    return (layer < base_nodes.size() ? base_nodes[layer] : 0) + parent.node_count(layer);
+  }
+  auto base_pointer(std::size_t layer, pointer target) const -> pointer;
+  auto base_children(std::size_t layer, const node& created) const -> node;
+
+  template<typename T, typename Emplace>
+  void deduplicate(hash_map<T>& map, std::size_t size,
+    const std::vector<std::vector<T>>& keys,
+    std::vector<std::vector<pointer>>& layers, Emplace&& emplace);
+
   shared_tree& parent;
-  std::vector<hash_map<node>> nodes;
+  std::deque<hash_map<node>> nodes;
   hash_map<dna> leaves;
   std::vector<pointer> roots;
+  std::size_t segment_depth = 0;  // Node layers that the segments of the input are padded to
+  std::size_t top = 0;            // Layer of the last root returned by reduce_roots()
+
+  // Sizes of the base that the tree is built against, if any, and the
+  // transformations that canonicalise each of its nodes, as the base may
+  // have been sorted since its construction. See base_index.
+  std::uint64_t base_leaves = 0;
+  std::vector<std::uint64_t> base_nodes;
+  std::vector<const std::uint8_t*> base_transforms;
+  unsigned threads;
+  std::size_t memory;  // Budget in payload bytes for the maps, or 0 if unbounded
+  bool compact;        // Whether saturated maps are compacted
 };
 
 /**
@@ -289,11 +982,31 @@ auto tree_constructor::reduce_leaves(Iterable&& iterable) -> std::vector<pointer
     nodes.emplace_back();
   }
 
-  // auto current_layer_lock = std::lock_guard{leaves_mutex};
-  // auto next_layer_lock = std::lock_guard{nodes_mutex[0]};
-  foreach_pair(iterable,
-    [&](auto left, auto right) { layer.emplace_back(emplace_leaves(left, right)); },
-    [&](auto last) { layer.emplace_back(emplace_leaves(last)); }
+  // Leaves are gathered in blocks, so that they can be canonicalised in bulk.
+  constexpr auto block_size = 256u;
+  auto strands = std::array<dna, block_size>{};
+  auto canonicals = std::array<dna, block_size>{};
+  auto transforms = std::array<std::uint8_t, block_size>{};
+  auto leaves = std::vector<pointer>{};
+  leaves.reserve(iterable.size());
+
+  auto filled = 0u;
+  auto flush = [&] {
+    dna::canonical(strands.data(), filled, canonicals.data(), transforms.data());
+    for (auto i = 0u; i < filled; ++i)
+      leaves.emplace_back(emplace_canonical_leaf(canonicals[i], transforms[i]));
+    filled = 0;
+  };
+
+  for (auto&& strand : iterable) {
+    strands[filled++] = strand;
+    if (filled == block_size) flush();
+  }
+  flush();
+
+  foreach_pair(leaves,
+    [&](auto left, auto right) { layer.emplace_back(emplace_node(0, left, right)); },
+    [&](auto last) { layer.emplace_back(emplace_node(0, last)); }
   );
   return layer;
 }
@@ -306,11 +1019,176 @@ template<typename Iterable>
 void tree_constructor::reduce_segment(Iterable&& segment) {
   auto layer = reduce_leaves(segment);
   // std::cout << "Layer sizes: " << leaves.load_factor() << ' ';
-  for (auto index = 1u; layer.size() > 1 || index < nodes.size(); ++index) {
+  auto index = 1u;
+  for (; layer.size() > 1 || index < segment_depth; ++index) {
     layer = reduce_nodes(layer, index);
     // std::cout << nodes[index-1].load_factor() << ' ';
   }
   // std::cout << '\n';
+  segment_depth = std::max<std::size_t>(segment_depth, index);
 
   roots.emplace_back(layer.front());
+}
+
+/**
+ * Reduces a batch of segments concurrently, as if each of them was passed to
+ * reduce_segment() in order. To guarantee that the resulting tree is identical
+ * to the one obtained from sequential reduction, the segments are reduced
+ * layer by layer: within a layer, new nodes are assigned indices in the order
+ * in which the sequential algorithm would encounter them.
+ */
+template<typename Segment>
+void tree_constructor::reduce_segments(const std::vector<Segment>& segments) {
+  const auto count = segments.size();
+  if (count == 0) return;
+
+  // Sequential reduction pads each segment up to the depth of the deepest
+  // segment before it, so determine how many node layers each one requires.
+  auto targets = std::vector<std::size_t>(count);
+  auto depth = segment_depth;
+  for (auto i = 0u; i < count; ++i) {
+    const auto size = static_cast<std::size_t>(std::distance(std::begin(segments[i]), std::end(segments[i])));
+    auto required = 1ul;
+    for (auto width = (size+1)/2; width > 1; width = (width+1)/2) ++required;
+    depth = std::max(depth, required);
+    targets[i] = depth;
+  }
+  segment_depth = depth;
+
+  auto keys = std::vector<std::vector<dna>>(count);
+  auto layers = std::vector<std::vector<pointer>>(count);
+  parallel_for(count, threads, [&](auto i) {
+    const auto begin = std::begin(segments[i]);
+    const auto size = static_cast<std::size_t>(std::distance(begin, std::end(segments[i])));
+    auto transforms = std::vector<std::uint8_t>(size);
+    keys[i].resize(size);
+    layers[i].resize(size);
+    dna::canonical(&*begin, size, keys[i].data(), transforms.data());
+    for (auto j = 0ul; j < size; ++j) {
+      layers[i][j] = pointer{0, bool(transforms[j] & dna::mirror_bit),
+        bool(transforms[j] & dna::transpose_bit), bool(transforms[j] & dna::invariant_bit)};
+    }
+  });
+  deduplicate(leaves, next_leaf(), keys, layers,
+    [&](const dna& leaf) { parent.emplace_leaf(leaf); });
+  keys.clear();
+
+  // Segments with the smallest target depth come first, so the segments still
+  // being reduced are always a suffix of the batch.
+  auto first = 0ul;
+  auto node_keys = std::vector<std::vector<node>>(count);
+  for (auto index = 0ul; first < count; ++index) {
+    if (nodes.size() <= index) {
+      parent.add_layer();
+      nodes.emplace_back();
+    }
+
+    parallel_for(count - first, threads, [&](auto offset) {
+      const auto i = first + offset;
+      const auto& children = layers[i];
+      const auto size = children.size()/2 + children.size()%2;
+      auto layer = std::vector<pointer>(size);
+      node_keys[i].clear();
+      node_keys[i].reserve(size);
+      for (auto j = 0ul; j < size; ++j) {
+        const auto left = children[2*j];
+        const auto right = (2*j+1 < children.size()) ? children[2*j+1] : pointer{nullptr};
+        const auto [canonical_node, mirror, transpose] = node{left, right}.canonical();
+        const auto invariant = (left == right.mirrored());
+        node_keys[i].emplace_back(canonical_node);
+        layer[j] = pointer{0, mirror, transpose, invariant};
+      }
+      layers[i] = std::move(layer);
+    });
+
+    for (auto i = 0ul; i < first; ++i) node_keys[i].clear();
+    deduplicate(nodes[index], next_node(index), node_keys, layers,
+      [&](const node& created) { parent.emplace_node(index, base_children(index, created)); });
+
+    // The segments keep pointing to canonical nodes, on which the next layer
+    // is keyed; only the roots point to nodes of the base as stored there.
+    while (first < count && targets[first] == index+1) {
+      assert(layers[first].size() == 1);
+      roots.emplace_back(base_pointer(index, layers[first].front()));
+      ++first;
+    }
+  }
+}
+
+/**
+ * Deduplicates the canonical keys of a whole layer of segments against the
+ * given map, and stores the resulting indices in the matching pointers.
+ * All segments are inserted concurrently, each key being claimed by its
+ * earliest occurrence in sequential order. Those first occurrences are then
+ * numbered in sequential order starting from <size> and passed to <emplace>
+ * in that same order, after which the remaining duplicates are resolved.
+ */
+template<typename T, typename Emplace>
+void tree_constructor::deduplicate(hash_map<T>& map, std::size_t size,
+  const std::vector<std::vector<T>>& keys,
+  std::vector<std::vector<pointer>>& layers, Emplace&& emplace)
+{
+  enum class state : std::uint8_t { known, candidate, first, duplicate };
+
+  const auto count = keys.size();
+  auto positions = std::vector<std::size_t>(count + 1, 0);
+  for (auto i = 0u; i < count; ++i)
+    positions[i+1] = positions[i] + keys[i].size();
+
+  auto set_index = [](pointer& target, std::size_t index) {
+    target = pointer{index, target.is_mirrored(), target.is_transposed(), target.is_invariant()};
+  };
+
+  // Claim all keys; those that are already present are resolved immediately.
+  auto states = std::vector<std::vector<state>>(count);
+  parallel_for(count, threads, [&](auto i) {
+    states[i].resize(keys[i].size());
+    for (auto j = 0u; j < keys[i].size(); ++j) {
+      const auto position = positions[i] + j;
+      const auto value = map.claim(keys[i][j], position);
+      if (!map.is_pending(value)) {
+        states[i][j] = state::known;
+        set_index(layers[i][j], value);
+      } else {
+        states[i][j] = (value == (map.pending | position)) ? state::candidate : state::duplicate;
+      }
+    }
+  });
+
+  // Only the earliest of the candidates for a key still holds its claim.
+  auto offsets = std::vector<std::size_t>(count + 1, size);
+  parallel_for(count, threads, [&](auto i) {
+    auto firsts = 0ul;
+    for (auto j = 0u; j < keys[i].size(); ++j) {
+      if (states[i][j] != state::candidate) continue;
+      if (map.lookup(keys[i][j]) == (map.pending | (positions[i] + j))) {
+        states[i][j] = state::first;
+        ++firsts;
+      } else {
+        states[i][j] = state::duplicate;
+      }
+    }
+    offsets[i+1] = firsts;
+  });
+  for (auto i = 0u; i < count; ++i) offsets[i+1] += offsets[i];
+  map.record(positions[count], positions[count] - (offsets[count] - size));
+
+  // Number the new keys in sequential order and publish their indices.
+  parallel_for(count, threads, [&](auto i) {
+    auto index = offsets[i];
+    for (auto j = 0u; j < keys[i].size(); ++j) {
+      if (states[i][j] != state::first) continue;
+      set_index(layers[i][j], index);
+      map.publish(keys[i][j], index++);
+    }
+  });
+
+  for (auto i = 0u; i < count; ++i)
+    for (auto j = 0u; j < keys[i].size(); ++j)
+      if (states[i][j] == state::first) emplace(keys[i][j]);
+
+  parallel_for(count, threads, [&](auto i) {
+    for (auto j = 0u; j < keys[i].size(); ++j)
+      if (states[i][j] == state::duplicate) set_index(layers[i][j], map.lookup(keys[i][j]));
+  });
 }
\ No newline at end of file
@@ -0,0 +1,44 @@
+/**
+ *  Choice of the number of nucleotides per leaf from samples of the input.
+ *  A few windows spread over the FASTA input are compressed at each candidate
+ *  leaf size, and the compressed size and time of the whole input are
+ *  extrapolated from those, so that no full run per candidate is needed.
+ */
+
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+class size_tuner {
+public:
+  struct estimate {
+    std::size_t dna_size;
+    std::uint64_t bytes;                // Estimated shared_tree::bytes() of the whole input
+    std::chrono::milliseconds time;     // Estimated time of construction and sorting
+  };
+
+  size_tuner(std::filesystem::path path, std::uint64_t sample_size = (1<<23), std::size_t windows = 16)
+  : size_tuner{std::vector{path}, sample_size, windows} {};
+  size_tuner(const std::vector<std::filesystem::path>& paths, std::uint64_t sample_size = (1<<23), std::size_t windows = 16);
+
+  auto sampled() const noexcept { return sample.size(); }
+  auto evaluate(std::size_t dna_size, unsigned threads = 1) const -> estimate;
+  auto evaluate(const std::vector<std::size_t>& dna_sizes, unsigned threads = 1) const -> std::vector<estimate>;
+  static auto choose(const std::vector<estimate>& estimates, double time_weight = 0) -> estimate;
+
+private:
+  struct measurement {
+    std::uint64_t bytes;
+    std::chrono::duration<double, std::milli> time;
+  };
+  void add_windows(const std::filesystem::path& path, std::uint64_t sample_size, std::size_t windows, std::size_t& count);
+  auto measure(const std::string& text, unsigned threads) const -> measurement;
+
+  std::string sample;   // Sequence lines of all windows
+  std::string half;     // Sequence lines of every other window
+  double scale = 1;     // Size of the input relative to the sample
+};
@@ -5,9 +5,18 @@
 
 #pragma once
 
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <functional>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 #include <tuple>
+#include <vector>
 
 /******************************************************************************
  *  Applies a functor to each consecutive pair. If the number of elements is
@@ -28,6 +37,224 @@ void foreach_pair(Iterable&& iterable, BinaryFunc binary_func, UnaryFunc unary_f
   }
 }
 
+/******************************************************************************
+ *  Pool of persistent worker threads. A job is run on a number of threads at
+ *  once, with the calling thread taking part as thread 0. Workers are started
+ *  when a job first needs them and then wait for the next job, so repeated
+ *  parallel sections do not pay for creating threads. Jobs submitted from
+ *  different threads run one after another, and a job submitted from inside
+ *  another job runs on the submitting thread alone.
+ */
+class thread_pool {
+public:
+  thread_pool() = default;
+  thread_pool(const thread_pool&) = delete;
+  thread_pool& operator=(const thread_pool&) = delete;
+
+  ~thread_pool() {
+    {
+      auto lock = std::lock_guard{mutex};
+      stopping = true;
+    }
+    start.notify_all();
+    for (auto& worker : workers) worker.join();
+  }
+
+  /**
+   *  Calls <job>(thread) for each thread in [0, threads) and returns once all
+   *  calls have completed. If a call throws, the first exception is rethrown
+   *  after the other calls have completed.
+   */
+  template<typename Func>
+  void run(unsigned threads, Func&& job) {
+    threads = std::max(threads, 1u);
+    if (threads == 1 || inside_job()) {
+      for (auto thread = 0u; thread < threads; ++thread) job(thread);
+      return;
+    }
+
+    auto section = std::lock_guard{serial};
+    auto lock = std::unique_lock{mutex};
+    while (workers.size() < threads - 1) {
+      const auto id = static_cast<unsigned>(workers.size() + 1);
+      workers.emplace_back([this, id, seen = generation] { work(id, seen); });
+    }
+    current = [&job](unsigned thread) { job(thread); };
+    participants = threads;
+    pending = threads - 1;
+    ++generation;
+    lock.unlock();
+    start.notify_all();
+
+    execute(0);
+
+    lock.lock();
+    finish.wait(lock, [&] { return pending == 0; });
+    current = nullptr;
+    if (failure) std::rethrow_exception(std::exchange(failure, nullptr));
+  }
+
+  /**
+   *  Pool shared by all parallel sections. It is never destroyed, so that
+   *  exiting from inside a job does not wait on the job's own thread.
+   */
+  static auto shared() -> thread_pool& {
+    static auto* pool = new thread_pool{};
+    return *pool;
+  }
+
+private:
+  static auto inside_job() -> bool& {
+    thread_local auto inside = false;
+    return inside;
+  }
+
+  void execute(unsigned thread) {
+    inside_job() = true;
+    try {
+      current(thread);
+    } catch (...) {
+      auto lock = std::lock_guard{mutex};
+      if (!failure) failure = std::current_exception();
+    }
+    inside_job() = false;
+  }
+
+  void work(unsigned id, std::size_t seen) {
+    auto lock = std::unique_lock{mutex};
+    while (true) {
+      start.wait(lock, [&] { return stopping || generation != seen; });
+      if (stopping) return;
+      seen = generation;
+      if (id >= participants) continue;
+
+      lock.unlock();
+      execute(id);
+      lock.lock();
+      if (--pending == 0) finish.notify_one();
+    }
+  }
+
+  std::mutex serial;
+  std::mutex mutex;
+  std::condition_variable start;
+  std::condition_variable finish;
+  std::vector<std::thread> workers;
+  std::function<void(unsigned)> current;
+  std::exception_ptr failure;
+  std::size_t generation = 0;
+  unsigned participants = 0;
+  unsigned pending = 0;
+  bool stopping = false;
+};
+
+/******************************************************************************
+ *  Applies a functor to each index in [0, count), dividing the indices over at
+ *  most <threads> threads of the shared pool in contiguous blocks. Runs on the
+ *  calling thread if only a single thread is requested.
+ */
+template<typename Func>
+void parallel_for(std::size_t count, unsigned threads, Func func) {
+  threads = static_cast<unsigned>(std::min<std::size_t>(std::max(threads, 1u), count));
+  if (threads <= 1) {
+    for (auto i = 0ul; i < count; ++i) func(i);
+    return;
+  }
+
+  thread_pool::shared().run(threads, [&](unsigned thread) {
+    const auto begin = thread*count/threads;
+    const auto end = (thread+1)*count/threads;
+    for (auto i = begin; i < end; ++i) func(i);
+  });
+}
+
+
+/******************************************************************************
+ *  Acyclic graph of tasks, executed by workers on the shared thread pool. A
+ *  task becomes ready once all tasks preceding it have completed, and ready
+ *  tasks are run most recent first, so that a started chain of work tends to
+ *  be finished before new work is begun.
+ */
+class task_graph {
+public:
+  auto add(std::function<void()> work) -> std::size_t {
+    tasks.push_back(task{std::move(work), {}, 0});
+    return tasks.size() - 1;
+  }
+
+  /**
+   *  Makes task <after> wait until task <before> has completed.
+   */
+  void precede(std::size_t before, std::size_t after) {
+    tasks[before].successors.push_back(after);
+    ++tasks[after].dependencies;
+  }
+
+  auto size() const noexcept { return tasks.size(); }
+
+  /**
+   *  Runs all tasks on <threads> workers, or on the calling thread if only a
+   *  single thread is requested. Calls <progress> with the number of completed
+   *  tasks after each task, one call at a time. If a task throws, no new tasks
+   *  are started and the exception is rethrown once all workers have stopped.
+   */
+  template<typename Func>
+  void run(unsigned threads, Func progress) {
+    auto remaining = std::vector<std::size_t>(tasks.size());
+    auto ready = std::vector<std::size_t>{};
+    for (auto i = 0ul; i < tasks.size(); ++i)
+      if ((remaining[i] = tasks[i].dependencies) == 0) ready.push_back(i);
+
+    auto mutex = std::mutex{};
+    auto condition = std::condition_variable{};
+    auto completed = std::size_t{0};
+    auto failure = std::exception_ptr{};
+
+    auto worker = [&] {
+      auto lock = std::unique_lock{mutex};
+      while (true) {
+        condition.wait(lock, [&] { return !ready.empty() || completed == tasks.size() || failure; });
+        if (completed == tasks.size() || failure) return;
+
+        const auto current = ready.back();
+        ready.pop_back();
+        lock.unlock();
+        try {
+          tasks[current].work();
+        } catch (...) {
+          lock.lock();
+          failure = std::current_exception();
+          condition.notify_all();
+          return;
+        }
+        lock.lock();
+
+        for (const auto successor : tasks[current].successors)
+          if (--remaining[successor] == 0) ready.push_back(successor);
+        progress(++completed);
+        condition.notify_all();
+      }
+    };
+
+    threads = static_cast<unsigned>(std::min<std::size_t>(std::max(threads, 1u), tasks.size()));
+    if (threads <= 1) worker();
+    else thread_pool::shared().run(threads, [&](unsigned) { worker(); });
+    if (failure) std::rethrow_exception(failure);
+  }
+
+  void run(unsigned threads) { run(threads, [](std::size_t) {}); }
+
+private:
+  struct task {
+    std::function<void()> work;
+    std::vector<std::size_t> successors;
+    std::size_t dependencies;
+  };
+
+  std::vector<task> tasks;
+};
+
+
 /******************************************************************************
  *  Hash function for an arbitrary set of arguments.
  *  Requires only that each argument be convertible to std::size_t.
@@ -193,6 +420,68 @@ void binary_read(std::istream& is, T& value, std::size_t bytes = sizeof(T)) {
   }
 }
 
+/**
+ *  Converts between native and big-endian byte order.
+ */
+inline auto swap_big_endian(std::uint64_t value) noexcept {
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  return __builtin_bswap64(value);
+#else
+  return value;
+#endif
+}
+
+/**
+ *  Stores the lower <bytes> bytes of <value> at <cursor> in big-endian order,
+ *  and advances <cursor> past them. Writes 8 bytes, so that at least that many
+ *  must be writable.
+ */
+inline void store_big_endian(unsigned char*& cursor, std::uint64_t value, std::size_t bytes) noexcept {
+  const auto encoded = swap_big_endian(value << (64 - 8*bytes));
+  std::memcpy(cursor, &encoded, sizeof(encoded));
+  cursor += bytes;
+}
+
+/**
+ *  Loads a big-endian value of <bytes> bytes at <cursor>, and advances
+ *  <cursor> past it. Reads 8 bytes, so that at least that many must be
+ *  readable.
+ */
+inline auto load_big_endian(const unsigned char*& cursor, std::size_t bytes) noexcept {
+  auto encoded = std::uint64_t{0};
+  std::memcpy(&encoded, cursor, sizeof(encoded));
+  cursor += bytes;
+  return swap_big_endian(encoded) >> (64 - 8*bytes);
+}
+
+/**
+ *  Buffered equivalent of binary_write, producing the same bytes. Values are
+ *  encoded into a large buffer with a single byte swap each, which is written
+ *  to the stream in blocks. The buffer is flushed on destruction.
+ */
+class binary_writer {
+public:
+  binary_writer(std::ostream& os, std::size_t capacity = 1 << 20)
+  : os{os}, buffer(capacity + 8), cursor{buffer.data()}, limit{buffer.data() + capacity} {}
+  ~binary_writer() { flush(); }
+
+  template<typename T, typename = std::enable_if_t<std::is_arithmetic_v<T>>>
+  void write(T value, std::size_t bytes = sizeof(T)) {
+    if (cursor >= limit) flush();
+    store_big_endian(cursor, value, bytes);
+  }
+
+  void flush() {
+    os.write(reinterpret_cast<const char*>(buffer.data()), cursor - buffer.data());
+    cursor = buffer.data();
+  }
+
+private:
+  std::ostream& os;
+  std::vector<unsigned char> buffer;
+  unsigned char* cursor;
+  unsigned char* limit;
+};
 
 /******************************************************************************
  * Formats a size in bytes into the appropriate number of B, KB, MB, etc.
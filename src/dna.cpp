@@ -1,5 +1,7 @@
 #include "dna.h"
 
+#include <algorithm>
+#include <array>
 #include <cassert>
 #include <cctype>
 #include <iostream>
@@ -9,43 +11,53 @@
 #include "fasta_reader.h"
 #include "utility.h"
 
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
 namespace fs = std::filesystem;
 
 /******************************************************************************
  * Helper functions for FASTA parsing.
  */
+/**
+ * Lookup table from ASCII characters to nucleic acid codes, in which invalid
+ * symbols are marked by 0xff.
+ */
+constexpr auto invalid_nac = std::uint8_t{0xff};
+
+constexpr auto make_nac_table() {
+  auto table = std::array<std::uint8_t, 256>{};
+  for (auto& entry : table) entry = invalid_nac;
+
+  constexpr auto codes = std::array{
+    std::pair{'A', nac::A}, std::pair{'C', nac::C}, std::pair{'G', nac::G},
+    std::pair{'T', nac::T}, std::pair{'R', nac::R}, std::pair{'Y', nac::Y},
+    std::pair{'K', nac::K}, std::pair{'M', nac::M}, std::pair{'S', nac::S},
+    std::pair{'W', nac::W}, std::pair{'B', nac::B}, std::pair{'D', nac::D},
+    std::pair{'H', nac::H}, std::pair{'V', nac::V}, std::pair{'N', nac::N}
+  };
+  for (const auto& [symbol, code] : codes) {
+    table[static_cast<unsigned char>(symbol)] = static_cast<std::uint8_t>(code);
+    table[static_cast<unsigned char>(symbol + ('a' - 'A'))] = static_cast<std::uint8_t>(code);
+  }
+  table['-'] = static_cast<std::uint8_t>(nac::Indeterminate);
+  return table;
+}
+
+constexpr auto nac_table = make_nac_table();
+
 bool valid_nac(char code) {
-  code = std::toupper(code);
-  return code == 'A' || code == 'C' || code == 'G' ||code == 'T'
-    || code == 'R' || code == 'Y' || code == 'K' || code == 'M'
-    || code == 'S' || code == 'W' || code == 'B' || code == 'D'
-    || code == 'H' || code == 'V' || code == 'N' || code == '-';
+  return nac_table[static_cast<unsigned char>(code)] != invalid_nac;
 }
 
 auto to_nac(char nucleotide) -> nac {
-  auto code = std::toupper(nucleotide);
-  switch (code) {
-    case 'A': return nac::A;
-    case 'C': return nac::C;
-    case 'G': return nac::G;
-    case 'T': return nac::T;
-    case 'R': return nac::R;
-    case 'Y': return nac::Y;
-    case 'K': return nac::K;
-    case 'M': return nac::M;
-    case 'S': return nac::S;
-    case 'W': return nac::W;
-    case 'B': return nac::B;
-    case 'D': return nac::D;
-    case 'H': return nac::H;
-    case 'V': return nac::V;
-    case 'N': return nac::N;
-    case '-': return nac::Indeterminate;
-    default : {
-      std::cerr << "Encountered unknown symbol: " << code << " (ASCII code " << static_cast<int>(code) << ")\n";
-      exit(1);
-    }
+  const auto code = nac_table[static_cast<unsigned char>(nucleotide)];
+  if (code == invalid_nac) {
+    std::cerr << "Encountered unknown symbol: " << nucleotide << " (ASCII code " << static_cast<int>(nucleotide) << ")\n";
+    exit(1);
   }
+  return static_cast<nac>(code);
 }
 
 constexpr auto from_nac(nac code) -> char {
@@ -78,13 +90,91 @@ constexpr auto from_nac(nac code) -> char {
  */
 dna::dna(const std::string_view strand) : nucleotides{0} {
   assert(strand.size() == length);
-  for (auto i = 0u; i < length; ++i) {
-    set(i, strand[i]);
+  if (!parse(strand.data(), *this)) {
+    const auto symbol = *std::find_if_not(strand.begin(), strand.end(), valid_nac);
+    to_nac(symbol);
   }
 }
 
 dna::dna(unsigned long long value) noexcept : nucleotides{value} {}
 
+/**
+ * Parses the <size()> nucleotides starting at <strand> into <result>, one
+ * symbol at a time. Returns false if any of them is not a valid FASTA nucleic
+ * acid code, in which case <result> is unspecified.
+ */
+auto dna::parse(const char* strand, dna& result) noexcept -> bool {
+  auto value = std::uint64_t{0};
+  auto invalid = std::uint8_t{0};
+  for (auto i = 0u; i < length; ++i) {
+    const auto code = nac_table[static_cast<unsigned char>(strand[i])];
+    invalid |= (code == invalid_nac);
+    value |= static_cast<std::uint64_t>(code & 0xf) << (4*i);
+  }
+  result.nucleotides = value;
+  return !invalid;
+}
+
+#if defined(__x86_64__)
+/**
+ * Vectorised parsing of a full 16-byte block of FASTA symbols.
+ * The high nibble of each symbol selects which of three 16-entry lookup tables
+ * applies: one for '-', one for A-O/a-o and one for P-Z/p-z. The low nibble
+ * then indexes that table through pshufb. Pairs of resulting nibbles are
+ * combined with a multiply-add and packed into a single 64-bit word.
+ */
+__attribute__((target("ssse3")))
+static auto parse_block(const char* block, std::uint64_t& value) noexcept -> std::uint32_t {
+  constexpr auto x = static_cast<char>(invalid_nac);
+  const auto dash_table = _mm_setr_epi8(x, x, x, x, x, x, x, x, x, x, x, x, x, 0b1111, x, x);
+  const auto low_table = _mm_setr_epi8(x, 0b0001, 0b0101, 0b0010, 0b1011, x, x, 0b0100,
+    0b1101, x, x, 0b0111, x, 0b1110, 0b0110, x);
+  const auto high_table = _mm_setr_epi8(x, x, 0b0011, 0b0000, 0b1000, x, 0b1010, 0b1001,
+    x, 0b1100, x, x, x, x, x, x);
+
+  const auto symbols = _mm_loadu_si128(reinterpret_cast<const __m128i*>(block));
+  const auto nibble_mask = _mm_set1_epi8(0x0f);
+  const auto low = _mm_and_si128(symbols, nibble_mask);
+  const auto high = _mm_and_si128(_mm_srli_epi16(symbols, 4), nibble_mask);
+  const auto folded = _mm_or_si128(high, _mm_set1_epi8(0x02));
+
+  const auto is_dash = _mm_cmpeq_epi8(high, _mm_set1_epi8(0x2));
+  const auto is_low = _mm_cmpeq_epi8(folded, _mm_set1_epi8(0x6));
+  const auto is_high = _mm_cmpeq_epi8(folded, _mm_set1_epi8(0x7));
+  const auto is_other = _mm_andnot_si128(_mm_or_si128(is_dash, _mm_or_si128(is_low, is_high)), _mm_set1_epi8(-1));
+
+  auto codes = _mm_and_si128(_mm_shuffle_epi8(dash_table, low), is_dash);
+  codes = _mm_or_si128(codes, _mm_and_si128(_mm_shuffle_epi8(low_table, low), is_low));
+  codes = _mm_or_si128(codes, _mm_and_si128(_mm_shuffle_epi8(high_table, low), is_high));
+  codes = _mm_or_si128(codes, is_other);
+
+  const auto invalid = static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(codes, _mm_set1_epi8(x))));
+  const auto pairs = _mm_maddubs_epi16(_mm_and_si128(codes, nibble_mask), _mm_set1_epi16(0x1001));
+  value = static_cast<std::uint64_t>(_mm_cvtsi128_si64(_mm_packus_epi16(pairs, pairs)));
+  return invalid;
+}
+
+static const auto has_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+
+/**
+ * Parses the <size()> nucleotides starting at <strand> into <result>.
+ * Unlike parse(), up to 16 characters may be read from <strand>, allowing the
+ * whole strand to be parsed at once using SIMD instructions where available.
+ */
+auto dna::parse_padded(const char* strand, dna& result) noexcept -> bool {
+#if defined(__x86_64__)
+  if (has_ssse3) {
+    auto value = std::uint64_t{};
+    const auto invalid = parse_block(strand, value);
+    const auto mask = (length == 16) ? ~0ull : (1ull << (4*length)) - 1;
+    result.nucleotides = value & mask;
+    return (invalid & ((1u << length) - 1)) == 0;
+  }
+#endif
+  return parse(strand, result);
+}
+
 /**
  *  Returns a random-initialised DNA strand. Used for testing purposes.
  */
@@ -112,12 +202,15 @@ auto dna::transposed() const noexcept -> dna {
 
 /**
  * Returns a mirrored version of the DNA strand.
+ * Reversing the bytes and then swapping the nibbles within each byte reverses
+ * the order of all 16 nucleotide slots; the strand then only needs to be
+ * shifted back to start at the lowest nibble.
  */
 auto dna::mirrored() const noexcept -> dna {
-  dna result{};
-  for (auto i = 0u; i < length; ++i)
-    result.set(i, code(length - i - 1));
-  return result;
+  auto v = __builtin_bswap64(nucleotides);
+  // swap consecutive nibbles
+  v = ((v >> 4) & 0x0f0f0f0f0f0f0f0f) | ((v & 0x0f0f0f0f0f0f0f0f) << 4);
+  return dna{v >> (4*(16 - length))};
 }
 
 /**
@@ -142,6 +235,103 @@ auto dna::canonical() const noexcept -> std::tuple<dna, bool, bool, bool> {
   return variadic_min(current, transpose, mirror, invert);
 }
 
+#if defined(__x86_64__)
+/**
+ * AVX2 versions of the similarity transforms, applied to four strands at once.
+ */
+__attribute__((target("avx2")))
+static inline auto transposed_avx2(__m256i v) noexcept {
+  const auto odd = _mm256_set1_epi64x(0x5555555555555555);
+  const auto pairs = _mm256_set1_epi64x(0x3333333333333333);
+  v = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi64(v, 1), odd), _mm256_slli_epi64(_mm256_and_si256(v, odd), 1));
+  v = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi64(v, 2), pairs), _mm256_slli_epi64(_mm256_and_si256(v, pairs), 2));
+  return v;
+}
+
+__attribute__((target("avx2")))
+static inline auto mirrored_avx2(__m256i v, __m128i shift) noexcept {
+  const auto reverse = _mm256_setr_epi8(
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8,
+    7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  const auto nibbles = _mm256_set1_epi64x(0x0f0f0f0f0f0f0f0f);
+  v = _mm256_shuffle_epi8(v, reverse);
+  v = _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi64(v, 4), nibbles), _mm256_slli_epi64(_mm256_and_si256(v, nibbles), 4));
+  return _mm256_srl_epi64(v, shift);
+}
+
+/**
+ * Replaces the lanes of <best> by those of <candidate> that are strictly
+ * smaller, as unsigned integers, updating the transformation bits to match.
+ */
+__attribute__((target("avx2")))
+static inline void select_avx2(__m256i& best, __m256i& transforms, __m256i candidate, std::uint8_t bits) noexcept {
+  const auto sign = _mm256_set1_epi64x(static_cast<long long>(0x8000000000000000ull));
+  const auto smaller = _mm256_cmpgt_epi64(_mm256_xor_si256(best, sign), _mm256_xor_si256(candidate, sign));
+  best = _mm256_blendv_epi8(best, candidate, smaller);
+  transforms = _mm256_blendv_epi8(transforms, _mm256_set1_epi64x(bits), smaller);
+}
+
+__attribute__((target("avx2")))
+static void canonical_avx2(const dna* strands, std::size_t count, dna* canonicals, std::uint8_t* transforms, std::size_t length) noexcept {
+  const auto shift = _mm_cvtsi64_si128(static_cast<long long>(4*(16 - length)));
+  auto i = 0ul;
+  for (; i + 4 <= count; i += 4) {
+    const auto current = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(strands + i));
+    const auto transpose = transposed_avx2(current);
+    const auto mirror = mirrored_avx2(current, shift);
+    const auto invert = mirrored_avx2(transpose, shift);
+
+    // Candidates are visited in the same order as in dna::canonical(), so
+    // that ties are resolved identically.
+    auto best = current;
+    auto bits = _mm256_setzero_si256();
+    select_avx2(best, bits, transpose, dna::transpose_bit);
+    select_avx2(best, bits, mirror, dna::mirror_bit);
+    select_avx2(best, bits, invert, dna::mirror_bit | dna::transpose_bit);
+    const auto invariant = _mm256_cmpeq_epi64(current, mirror);
+    bits = _mm256_or_si256(bits, _mm256_and_si256(invariant, _mm256_set1_epi64x(dna::invariant_bit)));
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(canonicals + i), best);
+    const auto packed = _mm256_shuffle_epi8(bits, _mm256_setr_epi8(
+      0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+      0, 8, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1));
+    const auto low = static_cast<std::uint32_t>(_mm256_extract_epi16(packed, 0));
+    const auto high = static_cast<std::uint32_t>(_mm256_extract_epi16(packed, 8));
+    transforms[i] = low & 0xff;
+    transforms[i+1] = low >> 8;
+    transforms[i+2] = high & 0xff;
+    transforms[i+3] = high >> 8;
+  }
+
+  for (; i < count; ++i) {
+    const auto [canonical, mirror, transpose, invariant] = strands[i].canonical();
+    canonicals[i] = canonical;
+    transforms[i] = (mirror ? dna::mirror_bit : 0) | (transpose ? dna::transpose_bit : 0)
+      | (invariant ? dna::invariant_bit : 0);
+  }
+}
+
+static const auto has_avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+/**
+ * Batched canonicalisation of <count> strands, equivalent to calling
+ * canonical() on each of them. The transformations are stored as a
+ * combination of mirror_bit, transpose_bit and invariant_bit.
+ * Where available, four strands are canonicalised at once using AVX2.
+ */
+void dna::canonical(const dna* strands, std::size_t count, dna* canonicals, std::uint8_t* transforms) noexcept {
+#if defined(__x86_64__)
+  if (has_avx2) return canonical_avx2(strands, count, canonicals, transforms, length);
+#endif
+  for (auto i = 0ul; i < count; ++i) {
+    const auto [canonical, mirror, transpose, invariant] = strands[i].canonical();
+    canonicals[i] = canonical;
+    transforms[i] = (mirror ? mirror_bit : 0) | (transpose ? transpose_bit : 0)
+      | (invariant ? invariant_bit : 0);
+  }
+}
+
 /**
  * Serializes the DNA strand into an output stream.
  * Big-endian storage format is used.
@@ -180,6 +370,17 @@ auto dna::nucleotide(std::size_t index) const -> char {
   return from_nac(nac);
 }
 
+/**
+ *  Writes the <size()> nucleotides of the strand to <output>, as FASTA symbols.
+ */
+void dna::to_chars(char* output) const noexcept {
+  // Symbols indexed by their nucleic acid code
+  constexpr auto symbols = std::string_view{"SACRGBNKTWVDYHM-"};
+  auto value = nucleotides;
+  for (auto i = 0u; i < length; ++i, value >>= 4)
+    output[i] = symbols[value & 0xf];
+}
+
 /**
  *  Internal helper function that sets the nucleotide located at <index> to
  *  <nucleotide>.
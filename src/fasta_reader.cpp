@@ -1,5 +1,5 @@
 /**
- *  Buffered file reader implementation for single-FASTA DNA sequences.
+ *  Buffered file reader implementation for FASTA DNA sequences.
  *  Allows one to read bigger DNA sequences without requiring them to be fully
  *  loaded in memory.
  */
@@ -7,64 +7,142 @@
 #include "fasta_reader.h"
 #include "dna.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
-#include <limits>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 fasta_reader::fasta_reader(std::filesystem::path path, std::size_t buffer_size)
-  : file{path}, path{path} {
-  if (!file.is_open()) {
+  : path{path} {
+  const auto descriptor = ::open(path.c_str(), O_RDONLY);
+  if (descriptor < 0) {
     std::cerr << "Unable to open file, aborting...\n";
     exit(1);
   }
 
+  file_size = std::filesystem::file_size(path);
+  if (file_size > 0) {
+    auto mapping = ::mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    if (mapping == MAP_FAILED) {
+      std::cerr << "Unable to map file into memory, aborting...\n";
+      exit(1);
+    }
+    ::madvise(mapping, file_size, MADV_SEQUENTIAL);
+    data = static_cast<const char*>(mapping);
+  }
+  ::close(descriptor);
 
   // Make sure that we do not allocate an unnecessarily big buffer.
-  const auto file_size = std::filesystem::file_size(path);
   const auto file_strands = file_size/dna::size()+1;
-
-  if (file_strands < buffer_size) {
-    buffer.resize(file_strands);
-    char_buffer.resize(file_strands*dna::size());
-  } else {
-    buffer.resize(buffer_size);
-    char_buffer.resize(buffer_size*dna::size());
-  }
+  capacity = std::min<std::size_t>(file_strands, buffer_size);
+  buffer.resize(capacity);
   buffer.shrink_to_fit();
-  char_buffer.shrink_to_fit();
   background_loader = std::thread{&fasta_reader::load_buffer, this};
 }
 
+fasta_reader::~fasta_reader() {
+  if (background_loader.joinable()) background_loader.join();
+  if (data) ::munmap(const_cast<char*>(data), file_size);
+}
+
 /**
- *  Loads the next data in the FASTA file into the background buffer.
+ *  Parses the next data in the FASTA file into the background buffer.
+ *  Header lines (starting with '>') start a new record in the record index,
+ *  and are skipped along with line endings. Strands that
+ *  lie within a single line are parsed directly from the mapped file; only
+ *  strands spanning a line break are gathered in a small local buffer first.
+ *  A trailing partial strand at the end of the file is discarded.
+ *  Invalid symbols are detected for the buffer as a whole, after which the
+ *  offending symbol is located and reported.
  */
 void fasta_reader::load_buffer() {
-  if (file.eof()) {
-    end_of_file = true;
-    return;
-  }
+  const auto length = dna::size();
+  const auto start = offset;
+  const auto start_of_line = line_start;
+  auto count = 0ul;
+  char strand[16] = {};
+  auto filled = 0ul;
+  auto valid = true;
+
+  // Vectorised parsing may read up to 16 characters, so near the end of the
+  // mapping strands are parsed one symbol at a time.
+  auto parse = [&](const char* begin) {
+    if (begin + 16 <= data + file_size) valid &= dna::parse_padded(begin, buffer[count++]);
+    else valid &= dna::parse(begin, buffer[count++]);
+  };
+
+  while (count < buffer.size() && offset < file_size) {
+    if (line_start && data[offset] == '>') {
+      const auto end = static_cast<const char*>(std::memchr(data + offset, '\n', file_size - offset));
+      const auto position = (strands + count)*length + filled;
+      auto header = std::string_view{data + offset + 1, std::size_t((end ? end : data + file_size) - data - offset - 1)};
+      if (!header.empty() && header.back() == '\r') header.remove_suffix(1);
+      if (index.empty() && position > 0) index.add("", 0);
+      index.add(header, position);
+      offset = end ? end - data + 1 : file_size;
+      continue;
+    }
 
-  auto position = 0lu;
-  while (position < char_buffer.size()) {
-    file.clear();
-    if (file.peek() == '>' || file.peek() == '\n') {
-      file.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    const auto newline = static_cast<const char*>(std::memchr(data + offset, '\n', file_size - offset));
+    auto line_end = newline ? static_cast<std::size_t>(newline - data) : file_size;
+    const auto next_line = newline ? line_end + 1 : file_size;
+    if (line_end > offset && data[line_end-1] == '\r') --line_end;
+    line_start = false;
+
+    if (filled > 0) {
+      const auto copied = std::min(length - filled, line_end - offset);
+      std::memcpy(strand + filled, data + offset, copied);
+      filled += copied;
+      offset += copied;
+      if (filled == length) {
+        valid &= dna::parse_padded(strand, buffer[count++]);
+        filled = 0;
+      }
     }
-    file.getline(&char_buffer[position], char_buffer.size() - position + 1, '\n');
-
-    // When a newline is found: failbit == false, actual line size = gcount() - 1
-    // When the buffer or file end is reached: failbit == true, actual line size = gcount()
-    const auto size = file.fail() || file.eof() ? file.gcount() : file.gcount() - 1;
-    position += size;
-    
-    if (file.eof()) {
-      char_buffer.resize(position/dna::size() * dna::size());
-      buffer.resize(char_buffer.size() / dna::size());
-      break;
+
+    while (offset + length <= line_end && count < buffer.size()) {
+      parse(data + offset);
+      offset += length;
     }
+    if (count == buffer.size() && offset < line_end) break;
+
+    std::memcpy(strand + filled, data + offset, line_end - offset);
+    filled += line_end - offset;
+    offset = next_line;
+    line_start = true;
   }
 
-  for (auto i = 0u; i < buffer.size(); ++i)
-    buffer[i] = dna{std::string_view{&char_buffer[i*dna::size()], dna::size()}};
+  if (!valid) report_invalid_symbol(start, start_of_line);
+  buffer.resize(count);
+  strands += count;
+  if (offset >= file_size) index.finish(strands*length + filled);
+}
+
+/**
+ *  Locates the first invalid symbol at or after <position>, outside of header
+ *  lines, and reports it before aborting.
+ */
+void fasta_reader::report_invalid_symbol(std::size_t position, bool start_of_line) const {
+  for (; position < file_size; ++position) {
+    const auto symbol = data[position];
+    if (start_of_line && symbol == '>') {
+      const auto end = static_cast<const char*>(std::memchr(data + position, '\n', file_size - position));
+      position = end ? end - data : file_size;
+      continue;
+    }
+
+    start_of_line = (symbol == '\n');
+    if (symbol == '\n' || symbol == '\r') continue;
+
+    if (!valid_nac(symbol)) {
+      std::cerr << "Encountered unknown symbol: " << symbol << " (ASCII code "
+        << static_cast<int>(symbol) << ") at byte " << position << " of " << path << '\n';
+      exit(1);
+    }
+  }
 }
 
 /**
@@ -81,7 +159,7 @@ auto fasta_reader::size() const -> std::size_t {
  * in its entirety.
  */
 auto fasta_reader::buffers() const -> std::size_t {
-  return size() / char_buffer.size();
+  return size() / (capacity*dna::size());
 }
 
 /**
@@ -94,8 +172,8 @@ bool fasta_reader::read_into(std::vector<dna>& vector) {
   if (background_loader.joinable()) background_loader.join();
   std::swap(buffer, vector);
 
-  if (!file.eof()) {
-    buffer.resize(vector.size());
+  if (offset < file_size) {
+    buffer.resize(capacity);
     buffer.shrink_to_fit();
     background_loader = std::thread{&fasta_reader::load_buffer, this};
   } else {
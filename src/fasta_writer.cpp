@@ -0,0 +1,104 @@
+/**
+ *  Buffered file writer for single-FASTA DNA sequences.
+ *  Nucleotides are gathered in a large buffer, so that output is written in
+ *  a few big blocks rather than strand by strand.
+ */
+
+#include "fasta_writer.h"
+#include "dna.h"
+
+#include <algorithm>
+
+fasta_writer::fasta_writer(std::ostream& os, std::size_t line_width, std::size_t buffer_size)
+  : os{os}, buffer(std::max<std::size_t>(buffer_size, 64)), line_width{line_width} {}
+
+/**
+ *  Writes a FASTA header line. Any sequence line in progress is ended first.
+ */
+void fasta_writer::header(std::string_view description) {
+  reserve(description.size() + 3);
+  if (column != 0) buffer[used++] = '\n';
+  column = 0;
+  buffer[used++] = '>';
+  std::copy(description.begin(), description.end(), &buffer[used]);
+  used += description.size();
+  buffer[used++] = '\n';
+}
+
+/**
+ *  Appends the nucleotides of a strand, breaking lines at the line width.
+ */
+void fasta_writer::write(const dna& strand) {
+  const auto length = dna::size();
+  reserve(2*length + 1);
+  written += length;
+
+  if (line_width == 0 || column + length <= line_width) {
+    strand.to_chars(&buffer[used]);
+    used += length;
+    column += length;
+    return;
+  }
+
+  char nucleotides[16];
+  strand.to_chars(nucleotides);
+  for (auto i = 0u; i < length; ++i) {
+    if (column == line_width) {
+      buffer[used++] = '\n';
+      column = 0;
+    }
+    buffer[used++] = nucleotides[i];
+    ++column;
+  }
+}
+
+/**
+ *  Appends nucleotides given as characters, breaking lines at the line width.
+ *  Used for records that do not start or end on a strand boundary.
+ */
+void fasta_writer::write(std::string_view nucleotides) {
+  written += nucleotides.size();
+  while (!nucleotides.empty()) {
+    if (line_width != 0 && column == line_width) {
+      reserve(1);
+      buffer[used++] = '\n';
+      column = 0;
+    }
+    const auto room = (line_width == 0) ? nucleotides.size() : line_width - column;
+    const auto count = std::min({room, nucleotides.size(), buffer.size() / 2});
+    reserve(count);
+    std::copy(nucleotides.begin(), nucleotides.begin() + count, &buffer[used]);
+    used += count;
+    column += count;
+    nucleotides.remove_prefix(count);
+  }
+}
+
+/**
+ *  Writes the buffered output to the underlying stream.
+ */
+void fasta_writer::flush() {
+  os.write(buffer.data(), used);
+  used = 0;
+}
+
+/**
+ *  Ends the last line and flushes the remaining output.
+ */
+void fasta_writer::close() {
+  if (column != 0) {
+    reserve(1);
+    buffer[used++] = '\n';
+    column = 0;
+  }
+  flush();
+  os.flush();
+}
+
+/**
+ *  Makes sure that at least <characters> more characters fit in the buffer.
+ */
+void fasta_writer::reserve(std::size_t characters) {
+  if (used + characters > buffer.size()) flush();
+  if (characters > buffer.size()) buffer.resize(characters);
+}
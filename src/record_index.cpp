@@ -0,0 +1,151 @@
+/**
+ *  Index of the records of a multi-record FASTA file.
+ */
+
+#include "record_index.h"
+#include "dna.h"
+#include "utility.h"
+
+#include <algorithm>
+
+/**
+ * Returns the name of the record: its header up to the first whitespace.
+ */
+auto record_index::record::name() const -> std::string_view {
+  const auto view = std::string_view{header};
+  return view.substr(0, view.find_first_of(" \t"));
+}
+
+/**
+ * Returns the index of the leaf holding the first nucleotide of the record.
+ */
+auto record_index::record::first_leaf() const noexcept -> std::uint64_t {
+  return start / dna::size();
+}
+
+/**
+ * Starts a new record at nucleotide <start>, which ends the previous record.
+ */
+void record_index::add(std::string_view header, std::uint64_t start) {
+  if (!records.empty()) records.back().length = start - records.back().start;
+  records.push_back(record{std::string{header}, start, 0});
+}
+
+/**
+ * Ends the last record at nucleotide <end>, and indexes the records on name.
+ */
+void record_index::finish(std::uint64_t end) {
+  if (!records.empty()) records.back().length = end - records.back().start;
+  sort_names();
+}
+
+void record_index::sort_names() {
+  by_name.resize(records.size());
+  for (auto i = 0ul; i < records.size(); ++i) by_name[i] = i;
+  std::stable_sort(by_name.begin(), by_name.end(),
+    [&](auto a, auto b) { return records[a].name() < records[b].name(); });
+}
+
+/**
+ * Returns the first record named <name>, or nullptr if there is none.
+ */
+auto record_index::find(std::string_view name) const -> const record* {
+  const auto match = std::lower_bound(by_name.begin(), by_name.end(), name,
+    [&](auto index, auto name) { return records[index].name() < name; });
+  if (match == by_name.end() || records[*match].name() != name) return nullptr;
+  return &records[*match];
+}
+
+/**
+ * Returns the index of the record containing nucleotide <position>, or the
+ * number of records if no record contains it.
+ */
+auto record_index::locate(std::uint64_t position) const -> std::size_t {
+  const auto next = std::upper_bound(records.begin(), records.end(), position,
+    [](auto position, const auto& record) { return position < record.start; });
+  if (next == records.begin() || position >= std::prev(next)->end()) return records.size();
+  return std::prev(next) - records.begin();
+}
+
+/**
+ * Resolves a region of the form "name", "name:begin" or "name:begin-end" to
+ * the range [first, last) of nucleotides in the strand. Positions are 1-based
+ * and inclusive, may contain thousands separators, and are clipped to the
+ * record. Names that contain colons themselves are matched as a whole first.
+ * Returns nothing if the name is unknown or the positions are invalid.
+ */
+auto record_index::resolve(std::string_view region) const
+  -> std::optional<std::pair<std::uint64_t, std::uint64_t>>
+{
+  if (const auto whole = find(region)) return std::pair{whole->start, whole->end()};
+
+  const auto colon = region.rfind(':');
+  if (colon == std::string_view::npos) return std::nullopt;
+  const auto match = find(region.substr(0, colon));
+  if (!match) return std::nullopt;
+
+  auto parse = [](std::string_view digits) -> std::optional<std::uint64_t> {
+    auto value = std::uint64_t{0};
+    auto any = false;
+    for (const auto digit : digits) {
+      if (digit == ',') continue;
+      if (digit < '0' || digit > '9') return std::nullopt;
+      value = 10*value + (digit - '0');
+      any = true;
+    }
+    if (!any) return std::nullopt;
+    return value;
+  };
+
+  const auto range = region.substr(colon + 1);
+  const auto dash = range.find('-');
+  const auto begin = parse(range.substr(0, dash));
+  const auto end = (dash == std::string_view::npos) ? std::optional{match->length} : parse(range.substr(dash + 1));
+  if (!begin || !end || *begin == 0 || *begin > *end || *begin > match->length) return std::nullopt;
+  return std::pair{match->start + *begin - 1, match->start + std::min(*end, match->length)};
+}
+
+/**
+ * Returns the number of bytes taken by the serialized index.
+ */
+auto record_index::bytes() const noexcept -> std::size_t {
+  auto bytes = sizeof(std::uint64_t);
+  for (const auto& record : records) bytes += sizeof(std::uint64_t) + sizeof(std::uint32_t) + record.header.size();
+  return bytes;
+}
+
+/**
+ * Serializes the index as the number of records, followed by the length and
+ * header of each record. Record starts follow from the lengths.
+ */
+void record_index::serialize(std::ostream& os) const {
+  binary_write(os, std::uint64_t(records.size()));
+  for (const auto& record : records) {
+    binary_write(os, record.length);
+    binary_write(os, std::uint32_t(record.header.size()));
+    os.write(record.header.data(), record.header.size());
+  }
+}
+
+auto record_index::deserialize(std::istream& is) -> record_index {
+  auto result = record_index{};
+  auto count = std::uint64_t{0};
+  binary_read(is, count);
+  auto start = std::uint64_t{0};
+  for (auto i = 0ul; i < count && is; ++i) {
+    auto length = std::uint64_t{0};
+    auto size = std::uint32_t{0};
+    binary_read(is, length);
+    binary_read(is, size);
+    auto header = std::string(size, '\0');
+    is.read(header.data(), size);
+    result.records.push_back(record{std::move(header), start, length});
+    start += length;
+  }
+  if (!is) {
+    std::cerr << "Record index is corrupt, aborting...\n";
+    exit(1);
+  }
+  result.sort_names();
+  return result;
+}
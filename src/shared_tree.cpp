@@ -5,10 +5,19 @@
  *  those trees. This does mean that unbalanced trees are not supported.
  */
 
+#include <atomic>
 #include <cmath>
-#include <future>
+#include <cstring>
 #include <limits>
-#include <numeric>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "shared_tree.h"
 
@@ -48,11 +57,23 @@ constexpr auto layer_segment(std::size_t index) noexcept {
   else return 0b11;
 }
 
+/**
+ * Offset within the last segment that escapes to a 32-bit offset following
+ * it, for indices from <escape_start> onward, which do not fit in 28 bits.
+ * The last offset of that segment encodes the null pointer.
+ */
+constexpr auto escape_offset = 0xffffffeull;
+constexpr auto null_offset = 0xfffffffull;
+constexpr auto escape_start = address_start(0b11) + escape_offset;
+
 /**
  * Helper function that determines the segment and offset an index belongs to.
+ * Escaped indices have the escape offset; their offset past <escape_start>
+ * follows separately.
  */
 constexpr auto compress_pointer(std::size_t index) noexcept {
-  if (index == 0x1fffffff) return std::pair{0b11, 0xfffffffull};
+  if (index == pointer::null_index) return std::pair{0b11, null_offset};
+  if (index >= escape_start) return std::pair{0b11, escape_offset};
   const auto segment = layer_segment(index);
   return std::pair{segment, index - address_start(segment)};
 }
@@ -61,58 +82,28 @@ constexpr auto compress_pointer(std::size_t index) noexcept {
  * Helper function that determines the index that a segment-offset pair
  * corresponds with.
  */
-constexpr auto decompress_pointer(std::size_t segment, std::size_t offset) noexcept {
-  if (segment == 0b11 && offset == 0xfffffff) return 0x1fffffffull;
+constexpr auto decompress_pointer(std::size_t segment, std::size_t offset) noexcept -> std::uint64_t {
+  if (segment == 0b11 && offset == null_offset) return pointer::null_index;
   return address_start(segment) + offset;
 }
 
 /**
- * Constructor from another pointer. Transformations can be applied to the
- * pointer, if necessary.
- * Note that a transposed nullptr must also be a nullptr, so that bits must
- * be set in this special case. This is the only case where a pointer is
- * invariant under transposition.
- */
-pointer::pointer(const pointer& other, bool mirror_, bool transpose_) noexcept
-: data{other.data},
-  mirror{mirror_ != other.mirror && !other.invariant},
-  transpose{transpose_ != other.transpose && other != nullptr},
-  invariant{other.invariant} {}
-
-/**
- * Constructor from an index with given similarity transforms.
- */
-pointer::pointer(std::size_t index, bool mirror_, bool transpose_, bool invariant_) noexcept
-: data{(std::uint32_t)index}, mirror{mirror_ && !invariant_}, transpose{transpose_}, invariant{invariant_} {}
-
-/**
- * Constructs a null pointer, indicating an empty subtree.
- * Null pointers have all data bits set and are of maximum pointer size. Due to
- * their infrequent occurrence, this bigger size is not an issue, while it
- * significantly simplifies the indexing code.
- * Mirror and transpose are false for all null pointers and their
- * transformations.
- */
-pointer::pointer(std::nullptr_t) noexcept
-: data{0x1fffffff}, mirror{false}, transpose{false}, invariant{true} {}
-
-/**
- * Returns the unsigned integer equivalent of the data stored in this
- * pointer. Note that the invariance bit is neglected.
+ * Returns the number of elements per layer that pointers can address.
  */
-auto pointer::to_ulong() const noexcept -> unsigned long {
-  return data
-  | ((std::uint32_t)mirror << (address_bits.back() + 1))
-  | ((std::uint32_t)transpose << (address_bits.back() + 2));
+auto pointer_capacity() noexcept -> std::uint64_t {
+  return std::min<std::uint64_t>(pointer::null_index, escape_start + (1ull << 32));
 }
 
-
 /**
- * Interprets the data as an index pointing to an inner node.
+ * Throws std::overflow_error if a layer of <size> elements cannot be addressed
+ * by pointers.
  */
-auto pointer::index() const noexcept -> std::size_t {
-  assert(!empty());
-  return data;
+void check_capacity(std::uint64_t size) {
+  if (size <= pointer_capacity()) return;
+  auto message = "Layer of " + std::to_string(size) + " elements exceeds the pointer capacity of "
+    + std::to_string(pointer_capacity());
+  if constexpr (sizeof(pointer) == 4) message += ", rebuild with -DSHARED_TREE_WIDE_POINTERS";
+  throw std::overflow_error{message};
 }
 
 /**
@@ -120,29 +111,83 @@ auto pointer::index() const noexcept -> std::size_t {
  * into account the pointer compression applied on serialization.
  */
 auto pointer::bytes() const noexcept -> std::size_t {
-  const auto [segment, offset] = compress_pointer(data);
-  return (4 + address_bits[segment])/8;
+  const auto [segment, offset] = compress_pointer(canonical());
+  return (4 + address_bits[segment])/8 + (offset == escape_offset ? 4 : 0);
 }
 
 /**
  * Serializes the pointer to the given output stream in compressed format.
  * Starts with the 4 header bits and the most significant 4 bits, then
  * repeatedly stores the next most significant byte, until no more bytes
- * remain.
+ * remain. Escaped pointers are followed by their 32-bit offset.
  */
 void pointer::serialize(std::ostream& os) const {
-  const auto [segment, offset] = compress_pointer(data);
+  const auto [segment, offset] = compress_pointer(canonical());
   int index = address_bits[segment]-4;
-  std::uint8_t store = offset >> index | mirror << 4 | transpose << 5 | segment << 6;
+  std::uint8_t store = offset >> index | is_mirrored() << 4 | is_transposed() << 5 | segment << 6;
   binary_write(os, store);
   for (index -= 8; index >= 0; index -= 8) {
     store = static_cast<std::uint8_t>(offset >> index);
     binary_write(os, store);
   }
+  if (offset == escape_offset) binary_write(os, std::uint32_t(canonical() - escape_start));
+}
+
+/**
+ * Returns the compressed encoding of <pointer> as a single big-endian integer,
+ * together with its size in bytes: the 4 header bits followed by the offset.
+ */
+auto encode_pointer(pointer pointer) noexcept {
+  const auto [segment, offset] = compress_pointer(pointer.canonical());
+  const auto header = std::uint64_t(pointer.is_mirrored() << 4 | pointer.is_transposed() << 5 | segment << 6);
+  const auto encoded = header << (pointer::address_bits[segment]-4) | offset;
+  if (offset == escape_offset) return std::pair{encoded << 32 | (pointer.canonical() - escape_start), std::size_t{8}};
+  return std::pair{encoded, std::size_t(segment+1)};
+}
+
+/**
+ * Returns the number of bytes of the compressed pointer at <cursor>.
+ */
+inline auto encoded_bytes(const unsigned char* cursor) noexcept {
+  if (cursor[0] < 0xc0) return std::size_t(cursor[0] >> 6) + 1;
+  const auto offset = (cursor[0] & 0xfull) << 24 | cursor[1] << 16 | cursor[2] << 8 | cursor[3];
+  return offset == escape_offset ? std::size_t{8} : std::size_t{4};
+}
+
+/**
+ * Decodes a compressed pointer, as written by pointer::serialize, and advances
+ * <cursor> past it. Null pointers decode to nullptr, so that they remain null
+ * under transformation.
+ */
+auto decode_pointer(const unsigned char*& cursor) noexcept {
+  const auto segment = std::size_t(cursor[0] >> 6);
+  const bool transpose = (cursor[0] >> 5) & 0x1;
+  const bool mirror = (cursor[0] >> 4) & 0x1;
+  auto offset = std::uint64_t(cursor[0] & 0xf);
+  for (auto i = 1u; i <= segment; ++i) offset = offset << 8 | cursor[i];
+  cursor += segment + 1;
+  if (segment == 0b11 && offset == escape_offset)
+    return pointer{escape_start + load_big_endian(cursor, 4), mirror, transpose, false};
+  if (segment == 0b11 && offset == null_offset) return pointer{nullptr};
+  return pointer{decompress_pointer(segment, offset), mirror, transpose, false};
+}
+
+/**
+ * Encodes the nodes in [first, last) at <cursor> in compressed format, and
+ * advances <cursor> past them. Writes up to 7 bytes beyond the encoding.
+ */
+void encode_nodes(const node* first, const node* last, unsigned char*& cursor) noexcept {
+  for (; first != last; ++first) {
+    const auto [left, left_bytes] = encode_pointer(first->left());
+    const auto [right, right_bytes] = encode_pointer(first->right());
+    store_big_endian(cursor, left, left_bytes);
+    store_big_endian(cursor, right, right_bytes);
+  }
 }
 
 /**
- * Loads a pointer from an input stream.
+ * Loads a pointer from an input stream. Null pointers decode to nullptr, so
+ * that they remain null under transformation.
  */
 auto pointer::deserialize(std::istream& is) -> pointer {
   std::uint8_t loaded;
@@ -158,6 +203,12 @@ auto pointer::deserialize(std::istream& is) -> pointer {
     offset |= ((std::uint64_t)loaded << index);
   }
 
+  if (segment == 0b11 && offset == escape_offset) {
+    std::uint32_t escaped;
+    binary_read(is, escaped);
+    return pointer{escape_start + escaped, mirror, transpose, false};
+  }
+  if (segment == 0b11 && offset == null_offset) return pointer{nullptr};
   auto data = decompress_pointer(segment, offset);
   return pointer{data, mirror, transpose, false};
 }
@@ -168,14 +219,6 @@ auto pointer::deserialize(std::istream& is) -> pointer {
  *  Node type representing inner nodes in the tree.
  *  Consists of two pointers to nodes or leaves one level down in the tree.
  */
-/**
- * Two nodes compare equal when they can be transformed into one another
- * through any possible combination of similarity transforms.
- */
-bool node::operator==(const node& other) const noexcept {
-  return children == other.children;
-}
-
 /**
  * Serializes the node to the given output stream.
  * First, the left pointer is stored, and then the right pointer.
@@ -203,17 +246,131 @@ auto node::deserialize(std::istream& is) -> node {
  */
 /**
  * Constructs a shared_tree from a FASTA formatted file.
+ * A non-zero <memory> bounds the payload bytes of the construction maps, which
+ * are spilled to the temporary directory when they grow beyond it. With
+ * <compact>, maps in which nearly all lookups hit are compacted in memory.
  */
-shared_tree::shared_tree(fasta_reader file, bool verbose) {
-  auto constructor = tree_constructor{*this};
+shared_tree::shared_tree(fasta_reader file, bool verbose, unsigned threads, std::size_t memory, bool compact) {
+  auto constructor = tree_constructor{*this, threads, memory, compact};
   root = constructor.reduce(file, verbose);
+  sequences = file.records();
 }
 
-shared_tree::shared_tree(std::vector<dna>& data, bool verbose) {
-  auto constructor = tree_constructor{*this};
+shared_tree::shared_tree(std::vector<dna>& data, bool verbose, unsigned threads, std::size_t memory, bool compact) {
+  auto constructor = tree_constructor{*this, threads, memory, compact};
   root = constructor.reduce(data, verbose);
 }
 
+/**
+ * Returns the number of leaves of <tree>, followed by the number of nodes in
+ * each of its layers.
+ */
+auto layer_sizes(const shared_tree& tree) {
+  auto sizes = std::vector<std::uint64_t>{tree.leaf_count()};
+  for (auto layer = 0ul; layer + 1 < tree.depth(); ++layer) sizes.push_back(tree.node_count(layer));
+  return sizes;
+}
+
+/**
+ * Constructs a delta tree from a FASTA formatted file, which holds only the
+ * leaves and nodes that are not already in the base of <base>, and refers to
+ * the rest of them in the base. Input is looked up through the runs of the
+ * base index, so that neither the base nor its index is modified, and both
+ * can be shared between processes. The root is padded up to the top layer,
+ * as the base may be deeper than the input. See rebase().
+ */
+shared_tree::shared_tree(fasta_reader file, const base_index& base, bool verbose, unsigned threads,
+                         std::size_t memory, bool compact) {
+  auto constructor = tree_constructor{*this, threads, memory, compact};
+  constructor.index_base(base);
+  base_sizes = layer_sizes(base.tree());
+
+  root = constructor.reduce(file, verbose, false);
+  root = constructor.raise(root, constructor.root_layer());
+  sequences = file.records();
+}
+
+/**
+ * Constructs a multi-genome shared_tree from several FASTA formatted files,
+ * one genome per file. See append().
+ */
+shared_tree::shared_tree(const std::vector<std::filesystem::path>& paths, bool verbose, unsigned threads,
+                         std::size_t memory, bool compact) {
+  append(paths, verbose, threads, memory, compact);
+}
+
+/**
+ * Adds the FASTA formatted files in <paths> to the tree, one genome per file.
+ * All genomes are deduplicated against the same maps, so that they share
+ * their leaves and nodes. A non-empty tree, such as a loaded one, is first
+ * canonicalised and indexed in these maps, after which only the new input is
+ * reduced. The root of each genome is padded up to the top layer, which thus
+ * holds one node per distinct genome.
+ */
+void shared_tree::append(const std::vector<std::filesystem::path>& paths, bool verbose, unsigned threads,
+                         std::size_t memory, bool compact) {
+  auto constructor = tree_constructor{*this, threads, memory, compact};
+  auto layers = std::vector<std::size_t>{};
+  if (!root.empty()) {
+    canonicalise();
+    constructor.index_tree(verbose);
+    if (genomes.empty()) genomes.push_back(genome_entry{root, sequences});
+    layers.assign(genomes.size(), nodes.size()-1);
+  }
+
+  for (const auto& path : paths) {
+    auto file = fasta_reader{path};
+    const auto root = constructor.reduce(file, verbose, false);
+    genomes.push_back(genome_entry{root, file.records()});
+    layers.push_back(constructor.root_layer());
+  }
+
+  for (auto i = 0ul; i < genomes.size(); ++i)
+    genomes[i].root = constructor.raise(genomes[i].root, layers[i]);
+  if (!genomes.empty()) {
+    root = genomes.front().root;
+    sequences = genomes.front().records;
+  }
+  if (genomes.size() == 1) genomes.clear();
+}
+
+/**
+ * Returns the complete tree of a delta tree, which resolves its pointers into
+ * <base>, the base the delta was built against, and keeps it alive. Elements
+ * of the base are read where it is held, e.g. from its mapped file, rather
+ * than copied. The result is still saved as a delta tree.
+ */
+auto shared_tree::rebase(std::shared_ptr<const shared_tree> base) const -> shared_tree {
+  assert(is_delta() && base && !base->is_delta());
+  if (layer_sizes(*base) != base_sizes) {
+    std::cerr << "Base does not match the base of the delta tree, aborting...\n";
+    exit(1);
+  }
+
+  auto result = *this;
+  result.base = std::move(base);
+  return result;
+}
+
+/**
+ * Returns a read-only view of genome <index>, which refers to the layers of
+ * this tree rather than copying them, and is valid for as long as this tree
+ * is not modified. Modifying the view copies the layers into memory.
+ */
+auto shared_tree::genome(std::size_t index) const -> shared_tree {
+  assert(index < genome_count());
+  auto result = shared_tree{};
+  result.leaves = mappable_vector<dna>::mapped(leaves.data(), leaves.size());
+  for (const auto& layer : nodes)
+    result.nodes.push_back(mappable_vector<node>::mapped(layer.data(), layer.size()));
+  result.root = genomes.empty() ? root : genomes[index].root;
+  result.sequences = genomes.empty() ? sequences : genomes[index].records;
+  result.mapping = mapping;
+  result.base_sizes = base_sizes;
+  result.base = base;
+  return result;
+}
+
 /**
  * Returns the total number of nodes in the tree.
  * Leafs are excluded.
@@ -229,7 +386,7 @@ auto shared_tree::node_count() const -> std::size_t {
  * <pointer>, depending on <index>.
  */
 auto shared_tree::access_leaf(pointer pointer) const -> dna {
-  auto leaf = leaves[pointer.index()];
+  auto leaf = leaf_at(pointer.index());
   if (pointer.is_mirrored()) leaf = leaf.mirrored();
   if (pointer.is_transposed()) leaf = leaf.transposed();
   return leaf;
@@ -240,7 +397,27 @@ auto shared_tree::access_leaf(pointer pointer) const -> dna {
  * Returned by value since since the nodes must be immutable anyway.
  */
 auto shared_tree::access_node(std::size_t layer, pointer pointer) const -> node {
-  return nodes[layer][pointer.index()];
+  return node_at(layer, pointer.index());
+}
+
+/**
+ * Returns the leaf at <index>. The leaves of a rebased delta tree are those
+ * of its base, followed by its own.
+ */
+auto shared_tree::leaf_at(std::size_t index) const -> const dna& {
+  if (!base) return leaves[index];
+  return index < base_sizes[0] ? base->leaves[index] : leaves[index - base_sizes[0]];
+}
+
+/**
+ * Returns the node at <index> in layer <layer>, which for a rebased delta
+ * tree is looked up in its base below the number of nodes in that layer of
+ * the base.
+ */
+auto shared_tree::node_at(std::size_t layer, std::size_t index) const -> const node& {
+  if (!base) return nodes[layer][index];
+  const auto split = (layer + 1 < base_sizes.size()) ? base_sizes[layer + 1] : 0;
+  return index < split ? base->nodes[layer][index] : nodes[layer][index - split];
 }
 
 /**
@@ -290,12 +467,175 @@ auto shared_tree::operator[](std::uint64_t index) const -> dna {
   return access_leaf(current);
 }
 
+/**
+ * Looks up the leaves at all <indices> at once, returned in the same order.
+ * The queries are visited in sorted order, so that consecutive queries share
+ * the path down to their common ancestor: a query only descends from the
+ * highest layer in which its index differs from the previous one. Leaves are
+ * prefetched as soon as their pointer is known and only read once all
+ * descents are done, which hides most of the latency of the random accesses.
+ * Precondition: every index < width
+ * Precondition: no nullptrs within the tree, only at the right edge
+ */
+auto shared_tree::access_batch(const std::vector<std::uint64_t>& indices) const -> std::vector<dna> {
+  const auto layers = nodes.size();
+  assert(layers < 64);
+
+  auto order = std::vector<std::pair<std::uint64_t, std::size_t>>(indices.size());
+  for (auto i = 0ul; i < indices.size(); ++i) order[i] = {indices[i], i};
+  std::sort(order.begin(), order.end());
+
+  // path[layer+1] points to the node in <layer> on the path to the previous
+  // query and path[0] to its leaf, path[layers] being the root.
+  auto path = std::array<pointer, 65>{};
+  path[layers] = root;
+  auto targets = std::vector<pointer>(order.size());
+  auto previous = ~std::uint64_t{0};
+
+  for (auto i = 0ul; i < order.size(); ++i) {
+    const auto index = order[i].first;
+    assert((index >> layers) == 0);
+    if (index == previous) {
+      targets[i] = targets[i-1];
+      continue;
+    }
+
+    const auto diverged = (previous == ~std::uint64_t{0}) ? layers-1
+      : std::size_t(63 - __builtin_clzll(index ^ previous));
+    for (auto layer = diverged+1; layer > 0; --layer) {
+      const auto current = path[layer];
+      const auto& node = node_at(layer-1, current.index());
+      const auto right = bool((index >> (layer-1)) & 1) != current.is_mirrored();
+      path[layer-1] = pointer{right ? node.right() : node.left(), current.is_mirrored(), current.is_transposed()};
+    }
+    targets[i] = path[0];
+    __builtin_prefetch(&leaf_at(path[0].index()));
+    previous = index;
+  }
+
+  auto result = std::vector<dna>(indices.size());
+  for (auto i = 0ul; i < order.size(); ++i) result[order[i].second] = access_leaf(targets[i]);
+  return result;
+}
+
+/**
+ * Applies <func> to consecutive blocks of the leaves in the range
+ * [first, last), in order.
+ * Descends from the root only once; subsequent leaves are found by walking
+ * back up to the nearest ancestor with an unvisited right subtree, so each
+ * step takes amortised constant time. The path is kept in a fixed-size
+ * stack, as the depth of the tree is bounded by the width of an index.
+ * Stops early at the end of the tree. Returns the number of leaves visited.
+ */
+auto shared_tree::for_each_block(std::uint64_t first, std::uint64_t last,
+                                 const std::function<void(const dna*, std::size_t)>& func) const -> std::uint64_t {
+  if (first >= last || root.empty()) return 0;
+  const auto layers = nodes.size();
+  assert(layers < 64);
+  if (first >> layers) return 0;
+
+  // children[layer] holds both children of the node in <layer> on the path to
+  // the current leaf, with the transformations of that node applied.
+  // right[layer] denotes whether the path continues to the right child.
+  auto children = std::array<std::array<pointer, 2>, 64>{};
+  auto right = std::array<bool, 64>{};
+
+  auto enter = [&](std::size_t layer, pointer current) {
+    const auto& node = node_at(layer, current.index());
+    const auto mirror = current.is_mirrored();
+    const auto transpose = current.is_transposed();
+    children[layer][0] = pointer{mirror ? node.right() : node.left(), mirror, transpose};
+    children[layer][1] = pointer{mirror ? node.left() : node.right(), mirror, transpose};
+  };
+
+  enter(layers-1, root);
+  for (auto layer = layers-1; layer > 0; --layer) {
+    right[layer] = (first >> layer) & 1;
+    const auto next = children[layer][right[layer]];
+    if (next.empty()) return 0;
+    enter(layer-1, next);
+  }
+  right[0] = first & 1;
+
+  constexpr auto block_size = 1024ul;
+  auto block = std::array<dna, block_size>{};
+  auto count = 0ul;
+  auto visited = std::uint64_t{0};
+  auto flush = [&] { func(block.data(), count); visited += count; count = 0; };
+
+  for (auto index = first; index < last; ++index) {
+    const auto leaf = children[0][right[0]];
+    if (leaf.empty()) break;
+    block[count++] = access_leaf(leaf);
+    if (count == block_size) flush();
+
+    // Move up to the first ancestor of which the right subtree is unvisited.
+    auto layer = 0ul;
+    while (layer < layers && right[layer]) ++layer;
+    if (layer == layers) break;
+    right[layer] = true;
+    for (; layer > 0; --layer) {
+      const auto next = children[layer][right[layer]];
+      if (next.empty()) break;
+      enter(layer-1, next);
+      right[layer-1] = false;
+    }
+    if (layer > 0) break;
+  }
+  if (count > 0) flush();
+  return visited;
+}
+
+/**
+ * Returns the leaves in the range [first, last) as packed DNA strands.
+ * The range is truncated at the end of the tree.
+ */
+auto shared_tree::extract_strands(std::uint64_t first, std::uint64_t last) const -> std::vector<dna> {
+  auto result = std::vector<dna>{};
+  if (first < last) result.reserve(last - first);
+  for_each_leaf(first, last, [&](const dna& leaf) { result.emplace_back(leaf); });
+  return result;
+}
+
+/**
+ * Writes the nucleotides in the range [begin, end) to <output>, including
+ * the parts of partially covered leaves at both ends of the range.
+ * The range is truncated at the end of the tree. Returns the number of
+ * nucleotides written.
+ */
+auto shared_tree::extract(std::uint64_t begin, std::uint64_t end, char* output) const -> std::size_t {
+  if (begin >= end) return 0;
+  const auto length = dna::size();
+  const auto first = begin / length;
+  const auto last = (end + length - 1) / length;
+
+  auto position = first * length;
+  auto written = 0ul;
+  for_each_leaf(first, last, [&](const dna& leaf) {
+    char nucleotides[16];
+    leaf.to_chars(nucleotides);
+    const auto from = std::max(begin, position) - position;
+    const auto to = std::min<std::uint64_t>(end - position, length);
+    std::copy(nucleotides + from, nucleotides + to, output + written);
+    written += to - from;
+    position += length;
+  });
+  return written;
+}
+
+auto shared_tree::extract(std::uint64_t begin, std::uint64_t end) const -> std::string {
+  auto result = std::string(begin < end ? end - begin : 0, '\0');
+  result.resize(extract(begin, end, result.data()));
+  return result;
+}
+
 /**
  * Adds a leaf to the leaves layer.
  * Precondition: no similar leaves are already present in this layer.
  * Precondition: the leaf passed is of canonical variant.
  */
 void shared_tree::emplace_leaf(dna leaf) {
+  check_capacity(leaves.size() + 1);
   leaves.emplace_back(leaf);
 }
 
@@ -304,6 +644,7 @@ void shared_tree::emplace_leaf(dna leaf) {
  * Precondition: no similar nodes are already present in this layer. 
  */
 void shared_tree::emplace_node(std::size_t layer, node node) {
+  check_capacity(nodes[layer].size() + 1);
   nodes[layer].emplace_back(node);
 }
 
@@ -345,44 +686,32 @@ void shared_tree::store_histogram(std::filesystem::path path) const {
 }
 
 /**
- * Helper functions in layer sorting.
+ * Replaces each frequency by the index its element gets when stably sorted on
+ * descending frequency, using a counting sort over the frequency values. This
+ * yields the same order as a stable comparison sort, in linear time.
  */
-auto iota(std::size_t size) {
-  auto vector = std::vector<std::size_t>(size);
-  std::iota(vector.begin(), vector.end(), 0);
-  return vector;
+void frequency_order(std::vector<std::size_t>& frequencies) {
+  const auto maximum = frequencies.empty() ? 0 :
+    *std::max_element(frequencies.begin(), frequencies.end());
+  auto offsets = std::vector<std::size_t>(maximum + 1, 0);
+  for (const auto frequency : frequencies)
+    ++offsets[frequency];
+
+  auto offset = std::size_t{0};
+  for (auto frequency = maximum + 1; frequency-- > 0;)
+    offset += std::exchange(offsets[frequency], offset);
+
+  for (auto& frequency : frequencies)
+    frequency = offsets[frequency]++;
 }
 
 /**
- * Inverts a vector of indices, so that the value i located at j
- * becomes the value of j located at i.
+ * Rewires the nodes in [first, last) to point to the correct children
+ * according to the child reshuffling as indicated by indices.
  */
-auto invert_indices(const std::vector<std::size_t>& indices) {
-  auto inverted = indices;
-  for (auto i = 0u; i < indices.size(); ++i)
-    inverted[indices[i]] = i;
-  return inverted;
-};
-
-/**
- * Returns the child layer, but then reordered so that child i is now located at
- * index indices[i].
- */
-template<typename T>
-auto reorder_layer(const std::vector<T>& children, const std::vector<std::size_t>& indices) {
-  auto reordered = children;
-  for (auto i = 0u; i < indices.size(); ++i)
-    reordered[indices[i]] = children[i];
-  return reordered;
-};
-
-/**
- * Rewires all nodes to point to the correct children according to the child
- * reshuffling as indicated by indices.
- */
-void shared_tree::rewire_nodes(std::size_t layer, const std::vector<std::size_t>& indices) {
+void rewire_range(node* first, node* last, const std::size_t* indices) {
   // Rewires a pointer to point to the same child, but then sorted.
-  auto rewire_pointer = [](auto old, const auto& indices) {
+  auto rewire_pointer = [&](auto old) {
     if (old.empty()) return old;
     const auto index = indices[old.index()];
     const auto mirror = old.is_mirrored();
@@ -391,102 +720,263 @@ void shared_tree::rewire_nodes(std::size_t layer, const std::vector<std::size_t>
     return pointer{index, mirror, transpose, invariant};
   };
 
-  // Rewires a node to point to its children, but sorted.
-  auto rewire_node = [&](auto old, const auto& indices) {
-    auto left = rewire_pointer(old.left(), indices);
-    auto right = rewire_pointer(old.right(), indices);
-    return node{left, right};
-  };
+  for (; first != last; ++first)
+    *first = node{rewire_pointer(first->left()), rewire_pointer(first->right())};
+}
+
+/**
+ * Applies the transformations <transforms>, as combined from dna::mirror_bit,
+ * dna::transpose_bit and dna::invariant_bit, to the node that <old> points to.
+ */
+auto transformed(pointer old, std::uint8_t transforms) noexcept {
+  if (old.empty()) return old;
+  return pointer{old.index(), old.is_mirrored() != bool(transforms & dna::mirror_bit),
+    old.is_transposed() != bool(transforms & dna::transpose_bit), bool(transforms & dna::invariant_bit)};
+}
 
-  std::transform(nodes[layer].begin(), nodes[layer].end(), nodes[layer].begin(),
-    [&](auto old) { return rewire_node(old, indices); });
+/**
+ * Returns the transformations that leave each of <leaves> canonical, which is
+ * only their invariance, as leaves are stored in canonical form.
+ */
+auto leaf_transforms(const mappable_vector<dna>& leaves) {
+  auto transforms = std::vector<std::uint8_t>(leaves.size());
+  for (auto i = 0ul; i < leaves.size(); ++i)
+    transforms[i] = leaves[i].invariant() ? dna::invariant_bit : 0;
+  return transforms;
 }
 
 /**
- * Sorts the leaves based on frequency of reference by the parent layer.
- * Also rewires the parent nodes to match this shuffle.
+ * Canonicalises each node of <layer>, of which the children are canonicalised
+ * by <below>, and passes it to <func> together with its index. Returns the
+ * transformations that canonicalised each node.
  */
-void shared_tree::sort_leaves() {
-  auto frequencies = histogram(0);
-  auto indices = iota(frequencies.size());
+template<typename Func>
+auto canonicalise_layer(const mappable_vector<node>& layer, const std::vector<std::uint8_t>& below, Func&& func) {
+  auto update = [&](pointer child) { return child ? transformed(child, below[child.index()]) : child; };
+  auto transforms = std::vector<std::uint8_t>(layer.size());
+  for (auto i = 0ul; i < layer.size(); ++i) {
+    const auto created = node{update(layer[i].left()), update(layer[i].right())};
+    const auto [canonical, mirror, transpose] = created.canonical();
+    func(i, canonical);
+    transforms[i] = (mirror ? dna::mirror_bit : 0) | (transpose ? dna::transpose_bit : 0)
+      | (created.left() == created.right().mirrored() ? dna::invariant_bit : 0);
+  }
+  return transforms;
+}
 
-  std::stable_sort(indices.begin(), indices.end(),
-    [&](auto a, auto b) { return frequencies[a] > frequencies[b]; });
+/**
+ * Brings every node back into the canonical form that construction gives it.
+ * Sorting does not preserve this form, as it changes the indices on which
+ * nodes are compared, and loading drops the invariance bits of pointers.
+ * Layers are canonicalised bottom-up, with each pointer taking over the
+ * transformations that canonicalised its child, so that every subtree still
+ * represents the same strands.
+ */
+void shared_tree::canonicalise() {
+  auto transforms = leaf_transforms(leaves);
+  for (auto& layer : nodes) {
+    auto canonicals = std::vector<node>(layer.size(), node{nullptr});
+    transforms = canonicalise_layer(layer, transforms, [&](auto i, auto canonical) { canonicals[i] = canonical; });
+    layer = std::move(canonicals);
+  }
 
+  root = transformed(root, transforms[root.index()]);
+  for (auto& genome : genomes) genome.root = transformed(genome.root, transforms[genome.root.index()]);
+}
 
-  indices = invert_indices(indices);
-  leaves = reorder_layer(leaves, indices);
-  rewire_nodes(0, indices);
+/**
+ * Rewires all nodes to point to the correct children according to the child
+ * reshuffling as indicated by indices.
+ */
+void shared_tree::rewire_nodes(std::size_t layer, const std::vector<std::size_t>& indices) {
+  auto& parents = nodes[layer].elements();
+  rewire_range(parents.data(), parents.data() + parents.size(), indices.data());
 }
 
 /**
- * Sorts the layer based on frequency of reference by its parent layer.
- * Also rewires those parent nodes to match this shuffle.
+ * Number of nodes handled by a single task in layer sorting.
  */
-void shared_tree::sort_nodes(std::size_t layer) {
-  auto frequencies = histogram(layer+1);
-  auto indices = iota(frequencies.size());
+constexpr auto sort_chunk = std::size_t{1} << 18;
 
-  std::stable_sort(indices.begin(), indices.end(),
-    [&](auto a, auto b) { return frequencies[a] > frequencies[b]; });
+/**
+ * Adds the tasks sorting <children> on frequency of reference by <parents> to
+ * the graph, and rewiring the parents to match this shuffle. References are
+ * counted, children are moved and parents are rewired in chunks that run in
+ * parallel. Returns the first and the last task of the sort, respectively.
+ */
+template<typename T>
+auto add_layer_sort(task_graph& graph, std::vector<T>& children, std::vector<node>& parents) {
+  struct state {
+    std::vector<std::atomic<std::size_t>> frequencies;
+    std::vector<std::size_t> indices;
+    std::vector<T> scratch;
+  };
+  auto sort = std::make_shared<state>();
+
+  // Runs <func> on each chunk of <count> elements, after <first> and before <last>
+  auto add_chunks = [&](std::size_t count, std::size_t first, std::size_t last, auto func) {
+    for (auto begin = 0ul; begin < count; begin += sort_chunk) {
+      const auto end = std::min(begin + sort_chunk, count);
+      const auto task = graph.add([=] { func(begin, end); });
+      graph.precede(first, task);
+      graph.precede(task, last);
+    }
+  };
 
-  indices = invert_indices(indices);
-  nodes[layer] = reorder_layer(nodes[layer], indices);
-  rewire_nodes(layer+1, indices);
+  const auto start = graph.add([=, &children] {
+    sort->frequencies = std::vector<std::atomic<std::size_t>>(children.size());
+  });
+
+  const auto order = graph.add([=, &children] {
+    sort->indices.resize(children.size());
+    for (auto i = 0ul; i < children.size(); ++i)
+      sort->indices[i] = sort->frequencies[i].load(std::memory_order_relaxed);
+    sort->frequencies = std::vector<std::atomic<std::size_t>>{};
+    frequency_order(sort->indices);
+    sort->scratch = children;
+  });
+
+  const auto finish = graph.add([=] { *sort = {}; });
+
+  add_chunks(parents.size(), start, order, [=, &parents](auto begin, auto end) {
+    for (auto i = begin; i < end; ++i) {
+      if (const auto left = parents[i].left(); left)
+        sort->frequencies[left.index()].fetch_add(1, std::memory_order_relaxed);
+      if (const auto right = parents[i].right(); right)
+        sort->frequencies[right.index()].fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+  add_chunks(children.size(), order, finish, [=, &children](auto begin, auto end) {
+    for (auto i = begin; i < end; ++i)
+      children[sort->indices[i]] = sort->scratch[i];
+  });
+  add_chunks(parents.size(), order, finish, [=, &parents](auto begin, auto end) {
+    rewire_range(parents.data() + begin, parents.data() + end, sort->indices.data());
+  });
+
+  return std::pair{start, finish};
 }
 
 /**
  * Sorts the pointers in each layer based on their relative reference count, to
  * reduce the pointers size required to refer to the most-referenced bits.
  * This further improves the effectiveness of pointer compression.
+ * Sorting a layer shuffles it and rewires its parents, so that neighbouring
+ * layers cannot be sorted at the same time. Therefore the leaves and every
+ * other layer are sorted first, and each remaining layer is sorted as soon as
+ * both of its neighbours are done.
  */
-void shared_tree::sort_tree(bool verbose) {
+void shared_tree::sort_tree(bool verbose, unsigned threads) {
   if (verbose)
     std::cout << progress_bar("Sorting nodes", 0, 1) << std::flush;
-  std::vector<std::future<void>> futures;
 
-  // Checks if a future is ready
-  auto ready = [](const auto& future) {
-    if (!future.valid()) return false;
-    return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
-  };
+  auto graph = task_graph{};
+  auto sorts = std::vector<std::pair<std::size_t, std::size_t>>{};
+  sorts.push_back(add_layer_sort(graph, leaves.elements(), nodes[0].elements()));
+  for (auto layer = 0u; layer < nodes.size()-1; ++layer)
+    sorts.push_back(add_layer_sort(graph, nodes[layer].elements(), nodes[layer+1].elements()));
 
-  futures.emplace_back(std::async(&shared_tree::sort_leaves, this));
-  for (auto layer = 1u; layer < nodes.size()-1; layer += 2)
-    futures.emplace_back(std::async(&shared_tree::sort_nodes, this, layer));
-
-  auto count = 0;
-  for (auto& future : futures) {
-    if (ready(future)) {
-      future.get();
-      ++count;
-      if (verbose)
-        std::cout << progress_bar("Sorting nodes", count, 2*futures.size()) << std::flush;
-    }
+  for (auto i = 1u; i < sorts.size(); i += 2) {
+    graph.precede(sorts[i-1].second, sorts[i].first);
+    if (i+1 < sorts.size()) graph.precede(sorts[i+1].second, sorts[i].first);
   }
 
-  futures.clear();
-  for (auto layer = 0u; layer < nodes.size()-1; layer += 2)
-    futures.emplace_back(std::async(&shared_tree::sort_nodes, this, layer));
-
-  for (auto& future : futures) {
-    if (ready(future)) {
-      future.get();
-      ++count;
-      if (verbose)
-        std::cout << progress_bar("Sorting nodes", count, 2*futures.size()) << std::flush;
-    }
-  }
+  const auto total = graph.size();
+  graph.run(threads, [&](auto completed) {
+    if (verbose && completed % 16 == 0)
+      std::cout << progress_bar("Sorting nodes", completed, total) << std::flush;
+  });
 
   if (verbose)
     std::cout << "\rSorting nodes: done." << spaces(100) << '\n';
 }
 
+/**
+ * Header of a DAG file: a magic string, the version of the format and the
+ * number of nucleotides per leaf, which must match dna::size() on loading.
+ */
+constexpr auto stream_magic = std::array<char, 8>{'S', 'H', 'T', 'D', 'A', 'G', '\r', '\n'};
+
+/**
+ * Magic string of a delta tree in DAG format, which replaces that of the
+ * header. The header is followed by the number of layers of the base and the
+ * size of each, from the leaves up.
+ */
+constexpr auto delta_magic = std::array<char, 8>{'S', 'H', 'T', 'D', 'L', 'T', '\r', '\n'};
+
+/**
+ * Section of a DAG file holding the record index of every genome in it: a
+ * magic string and the number of genomes, followed by their record indices.
+ * In the stream format, it follows the header; in the memory-mapped and
+ * indexed formats, it follows the last layer.
+ */
+constexpr auto records_magic = std::array<char, 8>{'S', 'H', 'T', 'R', 'E', 'C', '\r', '\n'};
+
+auto records_bytes(const std::vector<const record_index*>& genomes) noexcept {
+  auto bytes = records_magic.size() + sizeof(std::uint64_t);
+  for (const auto records : genomes) bytes += records->bytes();
+  return bytes;
+}
+
+void write_records(std::ostream& os, const std::vector<const record_index*>& genomes) {
+  os.write(records_magic.data(), records_magic.size());
+  binary_write(os, std::uint64_t(genomes.size()));
+  for (const auto records : genomes) records->serialize(os);
+}
+
+auto read_records(std::istream& is) -> std::vector<record_index> {
+  auto magic = std::array<char, 8>{};
+  auto count = std::uint64_t{0};
+  is.read(magic.data(), magic.size());
+  binary_read(is, count);
+  if (!is || magic != records_magic) {
+    std::cerr << "DAG file is corrupt, aborting...\n";
+    exit(1);
+  }
+  auto genomes = std::vector<record_index>{};
+  for (auto i = 0ul; i < count; ++i) genomes.push_back(record_index::deserialize(is));
+  return genomes;
+}
+
+/**
+ * Section of a multi-genome DAG file that follows its records section: a
+ * magic string, followed by the root of every genome.
+ */
+constexpr auto genomes_magic = std::array<char, 8>{'S', 'H', 'T', 'G', 'E', 'N', '\r', '\n'};
+
+/**
+ * Layout of the memory-mapped DAG format. All fields are stored in
+ * little-endian byte order.
+ */
+constexpr auto mapped_magic = std::array<char, 8>{'S', 'H', 'T', 'R', 'E', 'E', '\r', '\n'};
+constexpr auto indexed_magic = std::array<char, 8>{'S', 'H', 'T', 'I', 'D', 'X', '\r', '\n'};
+constexpr auto mapped_alignment = std::uint64_t{64};
+
+struct mapped_header {
+  std::array<char, 8> magic;
+  std::uint32_t version;
+  std::uint32_t dna_size;
+  std::uint32_t root;
+  std::uint32_t layers;
+  std::uint64_t leaf_count;
+  std::uint64_t leaf_offset;
+  std::uint64_t records_offset;
+};
+
+struct mapped_layer {
+  std::uint64_t offset;
+  std::uint64_t count;
+};
+
 /**
  * Computes the number of bytes required to store the compressed tree.
  */
 auto shared_tree::bytes() const noexcept -> std::size_t {
-  auto memory = root.bytes() + 8 + leaves.size()*dna::bytes();
+  auto memory = stream_magic.size() + 8 + records_bytes(genome_records());
+  if (!genomes.empty()) memory += genomes_magic.size();
+  if (is_delta()) memory += 8*(base_sizes.size() + 1);
+  for (const auto& genome : genomes) memory += genome.root.bytes();
+  memory += root.bytes() + 8 + leaves.size()*dna::bytes();
 
   for (const auto& layer : nodes) {
     memory += 8;  // Size of each layer is stored as 64 bits
@@ -495,20 +985,74 @@ auto shared_tree::bytes() const noexcept -> std::size_t {
   return memory;
 }
 
+/**
+ * Chunk of a layer that is encoded or decoded as a single task: nodes [begin,
+ * end) of <layer>, in which the leaves are layer 0. Layers are split into
+ * chunks so that big layers are divided over multiple threads too.
+ */
+struct layer_chunk {
+  std::size_t layer;
+  std::size_t begin;
+  std::size_t end;
+  std::uint64_t offset;   // Position of the encoded chunk in the buffer
+  std::uint64_t bytes;    // Size of the encoded chunk
+};
+
+constexpr auto chunk_size = std::size_t{1} << 16;
+
 /**
  * Serializes the balanced tree to an output stream.
  * First stores the root, then all layers.
  * Each layer is stored as its length (as std::uint64_t), followed by all
  * separate nodes.
+ * The layers are split in chunks, which are encoded concurrently by <threads>
+ * threads in windows of a few chunks per thread. Each window is written in
+ * order as soon as it is encoded, so that only the window is buffered rather
+ * than the encoding of the whole tree.
  */
-void shared_tree::serialize(std::ostream& os) const {
-  root.serialize(os);
-  binary_write(os, leaves.size());
-  for (const auto& leaf : leaves) leaf.serialize(os);
+void shared_tree::serialize(std::ostream& os, unsigned threads) const {
+  {
+    auto writer = binary_writer{os};
+    const auto [encoded, bytes] = encode_pointer(root);
+    writer.write(encoded, bytes);
+  }
 
-  for (const auto& layer : nodes) {
-    binary_write(os, layer.size());
-    for (const auto& node : layer) node.serialize(os);
+  auto chunks = std::vector<layer_chunk>{};
+  for (auto layer = 0u; layer <= nodes.size(); ++layer) {
+    const auto count = (layer == 0) ? leaves.size() : nodes[layer-1].size();
+    for (auto begin = 0ul; begin == 0 || begin < count; begin += chunk_size)
+      chunks.emplace_back(layer_chunk{layer, begin, std::min(begin + chunk_size, count), 0, 0});
+  }
+
+  // Chunks are encoded a window at a time, each into its own buffer, which is
+  // followed by 8 bytes of slack as values are stored as whole words.
+  const auto window = std::size_t{4} * std::max(threads, 1u);
+  auto buffers = std::vector<std::vector<unsigned char>>(std::min(window, chunks.size()));
+  for (auto first = 0ul; first < chunks.size(); first += window) {
+    const auto count = std::min(window, chunks.size() - first);
+    parallel_for(count, threads, [&](auto i) {
+      auto& chunk = chunks[first + i];
+      auto& buffer = buffers[i];
+      chunk.bytes = (chunk.begin == 0) ? sizeof(std::uint64_t) : 0;
+      if (chunk.layer == 0) {
+        chunk.bytes += (chunk.end - chunk.begin)*dna::bytes();
+        buffer.resize(chunk.bytes + sizeof(std::uint64_t));
+        auto cursor = buffer.data();
+        if (chunk.begin == 0) store_big_endian(cursor, leaves.size(), sizeof(std::uint64_t));
+        for (auto j = chunk.begin; j < chunk.end; ++j) store_big_endian(cursor, leaves[j], dna::bytes());
+        return;
+      }
+
+      const auto& layer = nodes[chunk.layer-1];
+      for (auto j = chunk.begin; j < chunk.end; ++j) chunk.bytes += layer[j].bytes();
+      buffer.resize(chunk.bytes + sizeof(std::uint64_t));
+      auto cursor = buffer.data();
+      if (chunk.begin == 0) store_big_endian(cursor, layer.size(), sizeof(std::uint64_t));
+      encode_nodes(layer.data() + chunk.begin, layer.data() + chunk.end, cursor);
+    });
+
+    for (auto i = 0ul; i < count; ++i)
+      os.write(reinterpret_cast<const char*>(buffers[i].data()), chunks[first + i].bytes);
   }
 }
 
@@ -516,86 +1060,944 @@ void shared_tree::serialize(std::ostream& os) const {
  * Deserializes a balanced tree from an input stream.
  * Assumes it is stored starting with the root, followed by each layer, with
  * each layer stored as its size followed by the serialized nodes.
+ * The stream is decoded in blocks of <block> bytes, so that the encoded tree
+ * is never held in memory as a whole. As pointers differ in width, the nodes
+ * within a block are found by a sequential scan, which only inspects the
+ * first byte of every pointer. The chunks found are then decoded
+ * concurrently by <threads> threads. A truncated last layer is dropped.
  */
-auto shared_tree::deserialize(std::istream& is) -> shared_tree {
+auto shared_tree::deserialize(std::istream& is, unsigned threads) -> shared_tree {
+  constexpr auto block = std::size_t{1} << 22;
+  auto buffer = std::vector<unsigned char>(block + sizeof(std::uint64_t));   // Slack for word-sized loads
+  const auto data = static_cast<const unsigned char*>(buffer.data());
+  auto size = std::size_t{0};     // Number of buffered bytes
+  auto offset = std::size_t{0};   // Position of the first unread byte in the buffer
+
+  // Bytes left in the stream, if it can tell, so that implausible layer sizes
+  // of corrupt files are not reserved
+  auto remaining = std::optional<std::uint64_t>{};
+  if (const auto start = is.tellg(); start >= 0 && is.seekg(0, std::ios::end)) {
+    remaining = std::uint64_t(is.tellg() - start);
+    is.seekg(start);
+  }
+  is.clear();
+
+  // Moves the unread bytes to the front of the buffer and fills it up from the
+  // stream. The slack is zeroed, so that scans stop safely at the end.
+  auto refill = [&] {
+    std::memmove(buffer.data(), buffer.data() + offset, size - offset);
+    size -= offset;
+    offset = 0;
+    is.read(reinterpret_cast<char*>(buffer.data() + size), block - size);
+    size += is.gcount();
+    if (remaining) *remaining -= is.gcount();
+    std::fill_n(buffer.data() + size, sizeof(std::uint64_t), 0);
+    return size;
+  };
+
   auto result = shared_tree{};
-  result.root = pointer::deserialize(is);
-  std::uint64_t size;
-  binary_read(is, size);
-  for (auto i = 0u; i < size; ++i)
-    result.leaves.emplace_back(dna::deserialize(is));
+  if (refill() == 0) return result;
+  auto cursor = data;
+  result.root = decode_pointer(cursor);
+  offset = cursor - data;
+  if (size - offset < 8) return result;
+  cursor = data + offset;
+  const auto leaf_count = load_big_endian(cursor, sizeof(std::uint64_t));
+  offset = cursor - data;
+
+  auto& leaves = result.leaves.elements();
+  if (remaining && leaf_count*dna::bytes() <= *remaining + (size - offset)) {
+    leaves.reserve(leaf_count);
+  }
+  while (leaves.size() < leaf_count) {
+    const auto count = std::min<std::uint64_t>(leaf_count - leaves.size(), (refill() - offset) / dna::bytes());
+    if (count == 0) break;
+    const auto first = leaves.size();
+    check_capacity(first + count);
+    leaves.resize(first + count);
+    parallel_for((count + chunk_size - 1) / chunk_size, threads, [&](auto i) {
+      auto cursor = data + offset + i*chunk_size*dna::bytes();
+      for (auto j = i*chunk_size; j < std::min((i+1)*chunk_size, count); ++j)
+        leaves[first + j] = load_big_endian(cursor, dna::bytes());
+    });
+    offset += count*dna::bytes();
+  }
 
-  while (true) {
-    binary_read(is, size);
-    if (!is) break;
+  while (refill() - offset >= 8) {
+    cursor = data + offset;
+    const auto count = load_big_endian(cursor, sizeof(std::uint64_t));
+    offset = cursor - data;
+    auto& layer = result.nodes.emplace_back().elements();
+    if (remaining && count*2 <= *remaining + (size - offset)) {
+      layer.reserve(count);
+    }
 
-    result.nodes.emplace_back();
-    result.nodes.back().reserve(size);
-    for (auto i = 0u; i < size; ++i)
-      result.nodes.back().emplace_back(node::deserialize(is));
+    while (layer.size() < count) {
+      // Splits the completely buffered nodes into chunks
+      auto chunks = std::vector<layer_chunk>{};
+      auto position = offset;
+      for (auto i = layer.size(); i < count && position < size; ++i) {
+        const auto left = encoded_bytes(data + position);
+        if (position + left >= size) break;
+        const auto bytes = left + encoded_bytes(data + position + left);
+        if (position + bytes > size) break;
+        if (chunks.empty() || chunks.back().end - chunks.back().begin == chunk_size)
+          chunks.emplace_back(layer_chunk{0, i, i, position, 0});
+        ++chunks.back().end;
+        position += bytes;
+      }
+      if (chunks.empty()) break;
+
+      check_capacity(chunks.back().end);
+      layer.resize(chunks.back().end, node{nullptr});
+      parallel_for(chunks.size(), threads, [&](auto i) {
+        const auto& chunk = chunks[i];
+        auto cursor = data + chunk.offset;
+        for (auto j = chunk.begin; j < chunk.end; ++j) {
+          const auto left = decode_pointer(cursor);
+          const auto right = decode_pointer(cursor);
+          layer[j] = node{left, right};
+        }
+      });
+      offset = position;
+      if (layer.size() < count) refill();
+    }
+
+    if (layer.size() < count) {
+      result.nodes.pop_back();
+      break;
+    }
   }
   return result;
 }
 
 /**
- * Saves a balanced tree to a file in DAG format.
+ * Reads the header of a DAG file, returning its version, its DNA size and
+ * whether it holds a delta tree.
  */
-void shared_tree::save(std::filesystem::path path) const {
-  auto file = std::ofstream{path};
-  serialize(file);
+auto read_stream_header(std::istream& is) {
+  auto magic = std::array<char, 8>{};
+  is.read(magic.data(), magic.size());
+  if (!is || (magic != stream_magic && magic != delta_magic)) {
+    std::cerr << "File is not in the expected DAG format, aborting...\n";
+    exit(1);
+  }
+  auto version = std::uint32_t{0};
+  auto dna_size = std::uint32_t{0};
+  binary_read(is, version);
+  binary_read(is, dna_size);
+  if (!is) {
+    std::cerr << "DAG file is corrupt, aborting...\n";
+    exit(1);
+  }
+  return std::tuple{version, dna_size, magic == delta_magic};
 }
 
+/**
+ * Returns the record index of every genome, in order.
+ */
+auto shared_tree::genome_records() const -> std::vector<const record_index*> {
+  if (genomes.empty()) return {&sequences};
+  auto result = std::vector<const record_index*>{};
+  for (const auto& genome : genomes) result.push_back(&genome.records);
+  return result;
+}
 
-/******************************************************************************
- * class shared_tree::iterator:
- *  Iterator over the tree.
+/**
+ * Saves a balanced tree to a file in DAG format: the header and the records
+ * section, followed by the serialized tree. Multi-genome trees store the root
+ * of every genome in between, and delta trees the sizes of their base after
+ * the header.
  */
-shared_tree::iterator::iterator(shared_tree& parent, std::size_t layer, pointer root) : parent{parent} {
-  if (root) {
-    stack.emplace_back(layer, root);
-    next_leaf();
+void shared_tree::save(std::filesystem::path path, unsigned threads) const {
+  auto file = std::ofstream{path, std::ios::binary};
+  const auto& magic = is_delta() ? delta_magic : stream_magic;
+  file.write(magic.data(), magic.size());
+  binary_write(file, stream_version);
+  binary_write(file, std::uint32_t(dna::size()));
+  if (is_delta()) {
+    binary_write(file, std::uint64_t(base_sizes.size()));
+    for (const auto size : base_sizes) binary_write(file, size);
   }
+  write_records(file, genome_records());
+  if (!genomes.empty()) {
+    file.write(genomes_magic.data(), genomes_magic.size());
+    for (const auto& genome : genomes) genome.root.serialize(file);
+  }
+  serialize(file, threads);
 }
 
 /**
- * Returns the DNA strand stored in the current leaf.
- * Mirrors and transposes it, if necessary.
- * Precondition: current stack top points to a leaf.
+ * Loads a balanced tree from a file in DAG format. Files in the memory-mapped
+ * format are recognised by their header and mapped rather than read; files in
+ * the indexed format are expanded into memory. Files of version 2 predate the
+ * records section, and are read without records. When the records section
+ * holds more than one genome, the roots of the genomes follow it. Delta
+ * trees are loaded without their base; see rebase().
+ * The DNA size stored in the file must match the current DNA size.
  */
-auto shared_tree::iterator::operator*() const noexcept -> dna {
-  auto top = stack.back().current;
-  return parent.access_leaf(top);
+auto shared_tree::load(std::filesystem::path path, unsigned threads) -> shared_tree {
+  auto file = std::ifstream{path, std::ios::binary};
+  if (!file.is_open()) {
+    std::cerr << "Unable to open file, aborting...\n";
+    exit(1);
+  }
+
+  auto magic = std::array<char, 8>{};
+  file.read(magic.data(), magic.size());
+  if (file && magic == mapped_magic) return map(path);
+  if (file && magic == indexed_magic) return indexed_tree{path}.expand();
+  file.clear();
+  file.seekg(0);
+
+  const auto [version, dna_size, delta] = read_stream_header(file);
+  if (version != stream_version && (version != 2 || delta)) {
+    std::cerr << "Unsupported version of the DAG format, aborting...\n";
+    exit(1);
+  }
+  if (dna_size != dna::size()) {
+    std::cerr << "File was compressed with a DNA size of " << dna_size << ", aborting...\n";
+    exit(1);
+  }
+  auto base_sizes = std::vector<std::uint64_t>{};
+  if (delta) {
+    auto count = std::uint64_t{0};
+    binary_read(file, count);
+    for (auto i = 0ul; i < count && file; ++i) binary_read(file, base_sizes.emplace_back());
+    if (!file || base_sizes.empty()) {
+      std::cerr << "DAG file is corrupt, aborting...\n";
+      exit(1);
+    }
+  }
+  auto genomes = (version == 2) ? std::vector<record_index>{} : read_records(file);
+  auto roots = std::vector<pointer>{};
+  if (genomes.size() > 1) {
+    file.read(magic.data(), magic.size());
+    for (auto i = 0ul; i < genomes.size() && file; ++i) roots.push_back(pointer::deserialize(file));
+    if (!file || magic != genomes_magic) {
+      std::cerr << "DAG file is corrupt, aborting...\n";
+      exit(1);
+    }
+  }
+
+  auto result = deserialize(file, threads);
+  result.base_sizes = std::move(base_sizes);
+  if (!genomes.empty()) result.sequences = genomes.front();
+  for (auto i = 0ul; i < roots.size(); ++i)
+    result.genomes.push_back(genome_entry{roots[i], std::move(genomes[i])});
+  return result;
 }
 
 /**
- *  Advances the iterator to the first leaf on the right of the current leaf.
- *  To achieve this, pops the last-found leaf off the stack and recurses on the
- *  remaining stack members until a leaf is found.
+ * Returns the DNA size a DAG file was compressed with, as stored in its
+ * header, so that it can be set before loading the file.
  */
-auto shared_tree::iterator::operator++() -> iterator& {
-  stack.pop_back();
-  next_leaf();
-  return *this;
+auto shared_tree::stored_dna_size(std::filesystem::path path) -> std::size_t {
+  auto file = std::ifstream{path, std::ios::binary};
+  if (!file.is_open()) {
+    std::cerr << "Unable to open file, aborting...\n";
+    exit(1);
+  }
+
+  auto header = mapped_header{};
+  file.read(reinterpret_cast<char*>(&header), sizeof(header));
+  if (file && (header.magic == mapped_magic || header.magic == indexed_magic)) return header.dna_size;
+  file.clear();
+  file.seekg(0);
+  return std::get<1>(read_stream_header(file));
 }
 
 /**
- *  Iterates over the tree nodes until a leaf is found, or the stack is empty.
- *  For each encountered node, determines if it is a leaf. If not, its children
- *  are added to the stack and we apply the same procedure to them, starting
- *  with the left child.
+ * Returns whether pointers, nodes and leaves are laid out in memory exactly
+ * as in the memory-mapped format: little-endian words, of which pointers hold
+ * the index in the lower 29 bits, followed by the mirror, transpose and
+ * invariance bits.
  */
-void shared_tree::iterator::next_leaf() {
-  while (!stack.empty()) {
-    auto status = stack.back();
-    // Leaf level is indicated as the maximum std::size_t value
-    if (status.layer == std::numeric_limits<std::size_t>::max()) return;
+auto has_mapped_layout() noexcept {
+  if constexpr (sizeof(dna) != 8 || sizeof(pointer) != 4) return false;
+  const auto probe = node{pointer{5, true, false, false}, nullptr};
+  std::uint32_t words[2];
+  std::memcpy(words, &probe, sizeof(words));
+  return words[0] == (5u | 1u << 29) && words[1] == (0x1fffffffu | 1u << 31);
+}
 
-    auto top = status.current;
-    auto node = parent.access_node(status.layer, status.current);
-    stack.pop_back();
+auto mapped_word(pointer pointer) noexcept -> std::uint32_t {
+  return pointer.to_ulong() | std::uint32_t(pointer.is_invariant()) << 31;
+}
 
-    // Apply mirroring and transposition, if necessary, and save the resulting
-    // state on the stack.
+auto mapped_pointer(std::uint32_t word) noexcept {
+  if ((word & 0x1fffffff) == 0x1fffffff) return pointer{nullptr};
+  return pointer{word & 0x1fffffff, bool(word >> 29 & 1), bool(word >> 30 & 1), bool(word >> 31)};
+}
+
+constexpr auto align_mapped(std::uint64_t offset) noexcept {
+  return (offset + mapped_alignment - 1) / mapped_alignment * mapped_alignment;
+}
+
+/**
+ * Output file of which the sections are aligned to <mapped_alignment>.
+ */
+struct archive_writer {
+  archive_writer(std::filesystem::path path) : stream{path, std::ios::binary} {}
+
+  void write(const void* data, std::uint64_t bytes) {
+    stream.write(static_cast<const char*>(data), bytes);
+    position += bytes;
+  }
+
+  void pad() {
+    static constexpr char zeros[mapped_alignment] = {};
+    write(zeros, align_mapped(position) - position);
+  }
+
+  /**
+   * Pads to the next alignment, writes the records section there and returns
+   * its offset.
+   */
+  auto write_records(const std::vector<const record_index*>& genomes) {
+    pad();
+    const auto offset = position;
+    ::write_records(stream, genomes);
+    position += records_bytes(genomes);
+    return offset;
+  }
+
+  std::ofstream stream;
+  std::uint64_t position = 0;
+};
+
+/**
+ * Saves a balanced tree to a file in the memory-mapped DAG format.
+ * The file starts with a fixed header, followed by a table with the offset
+ * and size of every layer. Leaves and layers are then stored as fixed-width
+ * arrays in their in-memory representation, each aligned to a cache line, so
+ * that the file can be queried without deserialization. The records section
+ * follows the last layer.
+ */
+void shared_tree::save_mapped(std::filesystem::path path) const {
+  if (!has_mapped_layout()) {
+    std::cerr << "Memory-mapped format is not supported on this platform, aborting...\n";
+    exit(1);
+  }
+  if (!genomes.empty() || is_delta()) {
+    std::cerr << "Memory-mapped format does not support multiple genomes or delta trees, aborting...\n";
+    exit(1);
+  }
+
+  auto header = mapped_header{mapped_magic, mapped_version, std::uint32_t(dna::size()),
+    mapped_word(root), std::uint32_t(nodes.size()), leaves.size(), 0};
+  auto table = std::vector<mapped_layer>(nodes.size());
+  auto offset = align_mapped(sizeof(header) + table.size()*sizeof(mapped_layer));
+  header.leaf_offset = offset;
+  offset = align_mapped(offset + leaves.size()*sizeof(dna));
+  for (auto layer = 0u; layer < nodes.size(); ++layer) {
+    table[layer] = mapped_layer{offset, nodes[layer].size()};
+    offset = align_mapped(offset + nodes[layer].size()*sizeof(node));
+  }
+
+  header.records_offset = offset;
+
+  auto file = archive_writer{path};
+  file.write(&header, sizeof(header));
+  file.write(table.data(), table.size()*sizeof(mapped_layer));
+  file.pad();
+  file.write(leaves.data(), leaves.size()*sizeof(dna));
+  for (const auto& layer : nodes) {
+    file.pad();
+    file.write(layer.data(), layer.size()*sizeof(node));
+  }
+  file.write_records({&sequences});
+}
+
+/**
+ * Returns the number of index samples stored for a layer of <count> nodes:
+ * the byte offset of every <sample_rate>-th node, followed by the total size.
+ */
+constexpr auto sample_count(std::uint64_t count) noexcept {
+  return (count + indexed_tree::sample_rate - 1) / indexed_tree::sample_rate + 1;
+}
+
+/**
+ * Saves a balanced tree to a file in the indexed DAG format.
+ * Leaves and nodes are stored in the same compact, variable-width encoding as
+ * by serialize(). Each layer is preceded by a sampled index holding the byte
+ * offset of every <sample_rate>-th node, which allows random access into the
+ * layer while decoding at most <sample_rate> nodes. The records section
+ * follows the last layer.
+ */
+void shared_tree::save_indexed(std::filesystem::path path) const {
+  if (!genomes.empty() || is_delta()) {
+    std::cerr << "Indexed format does not support multiple genomes or delta trees, aborting...\n";
+    exit(1);
+  }
+  auto header = mapped_header{indexed_magic, indexed_version, std::uint32_t(dna::size()),
+    mapped_word(root), std::uint32_t(nodes.size()), leaves.size(), 0};
+  auto table = std::vector<mapped_layer>(nodes.size());
+  auto samples = std::vector<std::vector<std::uint64_t>>(nodes.size());
+  auto offset = align_mapped(sizeof(header) + table.size()*sizeof(mapped_layer));
+  header.leaf_offset = offset;
+  offset = align_mapped(offset + leaves.size()*dna::bytes());
+  for (auto layer = 0u; layer < nodes.size(); ++layer) {
+    auto& index = samples[layer];
+    index.reserve(sample_count(nodes[layer].size()));
+    auto bytes = std::uint64_t{0};
+    for (auto i = 0u; i < nodes[layer].size(); ++i) {
+      if (i % indexed_tree::sample_rate == 0) index.emplace_back(bytes);
+      bytes += nodes[layer][i].bytes();
+    }
+    index.emplace_back(bytes);
+    table[layer] = mapped_layer{offset, nodes[layer].size()};
+    offset = align_mapped(offset + index.size()*sizeof(std::uint64_t) + bytes);
+  }
+  header.records_offset = offset;
+
+  auto file = archive_writer{path};
+  file.write(&header, sizeof(header));
+  file.write(table.data(), table.size()*sizeof(mapped_layer));
+  file.pad();
+  {
+    auto writer = binary_writer{file.stream};
+    for (const auto& leaf : leaves) writer.write(leaf.to_ullong(), dna::bytes());
+  }
+  file.position += leaves.size()*dna::bytes();
+  for (auto layer = 0u; layer < nodes.size(); ++layer) {
+    file.pad();
+    file.write(samples[layer].data(), samples[layer].size()*sizeof(std::uint64_t));
+    auto stream = std::vector<unsigned char>(samples[layer].back() + sizeof(std::uint64_t));
+    auto cursor = stream.data();
+    encode_nodes(nodes[layer].begin(), nodes[layer].end(), cursor);
+    file.write(stream.data(), samples[layer].back());
+  }
+  file.write_records({&sequences});
+}
+
+[[noreturn]] void abort_mapping(const char* reason) {
+  std::cerr << reason << ", aborting...\n";
+  exit(1);
+}
+
+/**
+ * Maps the file at <path> as a shared read-only mapping. Returns the mapping,
+ * which is empty if the file cannot be opened or mapped or is empty, and its
+ * size.
+ */
+auto map_file(std::filesystem::path path) {
+  auto error = std::error_code{};
+  const auto size = std::filesystem::file_size(path, error);
+  const auto descriptor = ::open(path.c_str(), O_RDONLY);
+  if (descriptor < 0 || error || size == 0) {
+    if (descriptor >= 0) ::close(descriptor);
+    return std::pair{std::shared_ptr<const void>{}, std::uint64_t{0}};
+  }
+  const auto data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor, 0);
+  ::close(descriptor);
+  if (data == MAP_FAILED) return std::pair{std::shared_ptr<const void>{}, std::uint64_t{0}};
+  return std::pair{std::shared_ptr<const void>{data,
+    [size](const void* data) { ::munmap(const_cast<void*>(data), size); }}, std::uint64_t{size}};
+}
+
+/**
+ * Maps the file at <path> as a shared read-only mapping, and validates its
+ * header against <magic> and <version>. Returns the mapping, its size and the
+ * header.
+ */
+auto map_archive(std::filesystem::path path, const std::array<char, 8>& magic, std::uint32_t version) {
+  if (!std::filesystem::is_regular_file(path)) abort_mapping("Unable to open file");
+  auto [mapping, size] = map_file(path);
+  if (!mapping) abort_mapping("Unable to map file into memory");
+  if (size < sizeof(mapped_header)) abort_mapping("File is not in the expected DAG format");
+  const auto data = mapping.get();
+
+  auto header = mapped_header{};
+  std::memcpy(&header, data, sizeof(header));
+  if (header.magic != magic) abort_mapping("File is not in the expected DAG format");
+  if (header.version != version) abort_mapping("Unsupported version of the DAG format");
+  if (!has_mapped_layout()) abort_mapping("Memory-mapped format is not supported on this platform");
+  if (header.dna_size != dna::size()) {
+    std::cerr << "File was compressed with a DNA size of " << header.dna_size << ", aborting...\n";
+    exit(1);
+  }
+  if (header.layers > (size - sizeof(header)) / sizeof(mapped_layer))
+    abort_mapping("DAG file is corrupt");
+  return std::tuple{mapping, size, header};
+}
+
+/**
+ * Returns whether an array of <count> elements of <width> bytes at <offset>
+ * is aligned and lies within a file of <size> bytes.
+ */
+constexpr auto valid_array(std::uint64_t offset, std::uint64_t count, std::uint64_t width, std::uint64_t size) {
+  return offset % mapped_alignment == 0 && offset <= size && count <= (size - offset) / width;
+}
+
+/**
+ * Returns entry <layer> of the layer table of a mapped file.
+ */
+auto mapped_entry(const char* bytes, std::size_t layer) {
+  auto entry = mapped_layer{};
+  std::memcpy(&entry, bytes + sizeof(mapped_header) + layer*sizeof(mapped_layer), sizeof(entry));
+  return entry;
+}
+
+/**
+ * Reads the records section of a mapped file, and returns the record index of
+ * its first genome, if any.
+ */
+auto mapped_records(const char* bytes, std::uint64_t size, const mapped_header& header) {
+  if (header.records_offset > size) abort_mapping("DAG file is corrupt");
+  auto section = std::istringstream{std::string(bytes + header.records_offset, size - header.records_offset)};
+  auto genomes = read_records(section);
+  return genomes.empty() ? record_index{} : std::move(genomes.front());
+}
+
+/**
+ * Maps a file in the memory-mapped DAG format, which takes constant time
+ * apart from reading the records section.
+ * The layers of the resulting tree refer directly to the mapped file, so that
+ * processes mapping the same file share its pages. The mapping is released
+ * once the tree and all of its copies are destroyed.
+ */
+auto shared_tree::map(std::filesystem::path path) -> shared_tree {
+  auto [mapping, size, header] = map_archive(path, mapped_magic, mapped_version);
+  const auto bytes = static_cast<const char*>(mapping.get());
+  if (!valid_array(header.leaf_offset, header.leaf_count, sizeof(dna), size))
+    abort_mapping("DAG file is corrupt");
+
+  auto result = shared_tree{};
+  result.mapping = mapping;
+  result.root = mapped_pointer(header.root);
+  result.leaves = mappable_vector<dna>::mapped(
+    reinterpret_cast<const dna*>(bytes + header.leaf_offset), header.leaf_count);
+  for (auto layer = 0u; layer < header.layers; ++layer) {
+    const auto entry = mapped_entry(bytes, layer);
+    if (!valid_array(entry.offset, entry.count, sizeof(node), size)) abort_mapping("DAG file is corrupt");
+    result.nodes.emplace_back(mappable_vector<node>::mapped(
+      reinterpret_cast<const node*>(bytes + entry.offset), entry.count));
+  }
+  result.sequences = mapped_records(bytes, size, header);
+  return result;
+}
+
+/**
+ * Writes <bytes> bytes from <data> at <offset> of the file opened as
+ * <descriptor>.
+ */
+void write_at(int descriptor, const void* data, std::size_t bytes, std::size_t offset) {
+  auto source = static_cast<const char*>(data);
+  while (bytes > 0) {
+    const auto written = ::pwrite(descriptor, source, bytes, offset);
+    if (written < 0) abort_mapping("Unable to write spilled tree");
+    source += written;
+    bytes -= written;
+    offset += written;
+  }
+}
+
+/**
+ * Reads <bytes> bytes at <offset> of the file opened as <descriptor> into
+ * <data>.
+ */
+void read_at(int descriptor, void* data, std::size_t bytes, std::size_t offset) {
+  auto target = static_cast<char*>(data);
+  while (bytes > 0) {
+    const auto read = ::pread(descriptor, target, bytes, offset);
+    if (read <= 0) abort_mapping("Unable to read spilled tree");
+    target += read;
+    bytes -= read;
+    offset += read;
+  }
+}
+
+/**
+ * Creates a scratch file of <bytes> bytes at <path>. It is unlinked right away,
+ * so that it disappears once its descriptor is closed.
+ */
+auto create_scratch(const std::filesystem::path& path, std::size_t bytes) -> int {
+  const auto descriptor = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (descriptor < 0) abort_mapping("Unable to create scratch file");
+  ::unlink(path.c_str());
+  if (::ftruncate(descriptor, bytes) != 0) abort_mapping("Unable to create scratch file");
+  return descriptor;
+}
+
+/**
+ * Sorts a layer of a tree spilled to the mapped file opened as <descriptor>
+ * on the reference count by its parents, and rewires its parents to match
+ * this shuffle, giving the same order as frequency_order(). Both are written
+ * back to the file in place.
+ * Reference counts, and then the new positions, go to <positions>, which maps
+ * a scratch file. The layer is cut into runs that fit in <memory> bytes, which
+ * are sorted and spilled to the scratch file <runs>. These runs are merged
+ * straight into the layer through a small buffer per run, each of which is
+ * released once its run is consumed. Returns the most bytes buffered at once.
+ */
+template<typename T>
+auto sort_spilled_layer(int descriptor, const char* base, int runs, std::size_t* positions,
+                        const mappable_vector<T>& children, const mappable_vector<node>& parents,
+                        std::size_t memory) -> std::size_t {
+  // Elements are copied as raw bytes, as T need not be default constructible.
+  struct entry {
+    std::size_t frequency;
+    std::size_t index;
+    std::array<char, sizeof(T)> element;
+  };
+  struct run_cursor {
+    std::vector<entry> buffer;
+    std::size_t next;
+    std::size_t read;
+    std::size_t end;
+  };
+  // Descending frequency, ties broken on position as in a stable sort.
+  auto before = [](const entry& a, const entry& b) {
+    return a.frequency != b.frequency ? a.frequency > b.frequency : a.index < b.index;
+  };
+
+  const auto count = children.size();
+  std::fill_n(positions, count, 0);
+  for (const auto& parent : parents) {
+    if (const auto left = parent.left(); !left.empty()) ++positions[left.index()];
+    if (const auto right = parent.right(); !right.empty()) ++positions[right.index()];
+  }
+
+  const auto run_size = std::max<std::size_t>(memory / sizeof(entry), 1);
+  const auto run_count = (count + run_size - 1) / run_size;
+  auto peak = std::size_t{0};
+  {
+    auto run = std::vector<entry>{};
+    run.reserve(std::min(run_size, count));
+    peak = run.capacity()*sizeof(entry);
+    for (auto begin = 0ul; begin < count; begin += run_size) {
+      const auto end = std::min(begin + run_size, count);
+      run.clear();
+      for (auto i = begin; i < end; ++i) {
+        auto& added = run.emplace_back(entry{positions[i], i, {}});
+        std::memcpy(added.element.data(), &children[i], sizeof(T));
+      }
+      std::sort(run.begin(), run.end(), before);
+      write_at(runs, run.data(), run.size()*sizeof(entry), begin*sizeof(entry));
+    }
+  }
+
+  // Splits what remains of the budget between the run buffers and the output.
+  const auto overhead = run_count*(sizeof(run_cursor) + sizeof(std::size_t));
+  const auto buffer_size = std::max<std::size_t>(
+    (memory > overhead ? memory - overhead : 0) / ((run_count + 1)*sizeof(entry)), 1);
+  auto cursors = std::vector<run_cursor>(run_count);
+  auto refill = [&](run_cursor& run) {
+    run.buffer.resize(std::min(buffer_size, run.end - run.read));
+    read_at(runs, run.buffer.data(), run.buffer.size()*sizeof(entry), run.read*sizeof(entry));
+    run.read += run.buffer.size();
+    run.next = 0;
+  };
+  // Heap of runs, with the run holding the first entry on top.
+  auto heap = std::vector<std::size_t>{};
+  heap.reserve(run_count);
+  auto later = [&](std::size_t a, std::size_t b) {
+    return before(cursors[b].buffer[cursors[b].next], cursors[a].buffer[cursors[a].next]);
+  };
+  for (auto i = 0ul; i < run_count; ++i) {
+    cursors[i].read = i*run_size;
+    cursors[i].end = std::min(cursors[i].read + run_size, count);
+    refill(cursors[i]);
+    heap.push_back(i);
+    std::push_heap(heap.begin(), heap.end(), later);
+  }
+
+  auto output = std::vector<char>(std::min(buffer_size, count)*sizeof(T));
+  peak = std::max(peak, overhead + run_count*buffer_size*sizeof(entry) + output.size());
+  const auto layer = static_cast<std::size_t>(reinterpret_cast<const char*>(children.data()) - base);
+  auto position = std::size_t{0};
+  auto buffered = std::size_t{0};
+  auto flush = [&] {
+    write_at(descriptor, output.data(), buffered*sizeof(T), layer + (position - buffered)*sizeof(T));
+    buffered = 0;
+  };
+  while (!heap.empty()) {
+    std::pop_heap(heap.begin(), heap.end(), later);
+    auto& run = cursors[heap.back()];
+    const auto& first = run.buffer[run.next++];
+    positions[first.index] = position++;
+    std::memcpy(output.data() + buffered++*sizeof(T), first.element.data(), sizeof(T));
+    if (buffered*sizeof(T) == output.size())
+      flush();
+
+    if (run.next == run.buffer.size()) {
+      if (run.read == run.end) {
+        std::vector<entry>{}.swap(run.buffer);
+        heap.pop_back();
+        continue;
+      }
+      refill(run);
+    }
+    std::push_heap(heap.begin(), heap.end(), later);
+  }
+  flush();
+
+  const auto chunk_size = std::max<std::size_t>(std::min(sort_chunk, memory / sizeof(node)), 1);
+  auto chunk = std::vector<node>{};
+  chunk.reserve(std::min(chunk_size, parents.size()));
+  peak = std::max(peak, chunk.capacity()*sizeof(node));
+  for (auto begin = 0ul; begin < parents.size(); begin += chunk_size) {
+    const auto end = std::min(begin + chunk_size, parents.size());
+    chunk.assign(parents.data() + begin, parents.data() + end);
+    rewire_range(chunk.data(), chunk.data() + chunk.size(), positions);
+    write_at(descriptor, chunk.data(), chunk.size()*sizeof(node),
+      reinterpret_cast<const char*>(parents.data() + begin) - base);
+  }
+  return peak;
+}
+
+/**
+ * Sorts the tree out of core, giving the same result as sort_tree(). The tree
+ * is first spilled to <path> in the memory-mapped DAG format, after which it
+ * refers to that file. Layers are then sorted one at a time with an external
+ * merge sort, buffering at most <memory> bytes; the per-element positions and
+ * the sorted runs live in scratch files next to <path>, and like the tree
+ * itself stay in the page cache, from which they can be evicted.
+ * Afterwards, <path> holds the sorted tree, and must be kept for as long as the
+ * tree is in use. Returns the most bytes buffered at once.
+ */
+auto shared_tree::sort_on_disk(std::filesystem::path path, bool verbose, std::size_t memory) -> std::size_t {
+  auto roots = std::move(genomes);
+  save_mapped(path);
+  *this = map(path);
+  genomes = std::move(roots);
+
+  const auto descriptor = ::open(path.c_str(), O_RDWR);
+  if (descriptor < 0) abort_mapping("Unable to open file");
+  const auto base = static_cast<const char*>(mapping.get());
+
+  auto largest = leaves.size();
+  for (const auto& layer : nodes)
+    largest = std::max(largest, layer.size());
+  auto scratch = path;
+  const auto runs = create_scratch(scratch.concat(".runs"), 0);
+  scratch = path;
+  const auto indices = create_scratch(scratch.concat(".positions"), largest*sizeof(std::size_t));
+  auto positions = static_cast<std::size_t*>(nullptr);
+  if (largest > 0) {
+    const auto data = ::mmap(nullptr, largest*sizeof(std::size_t), PROT_READ | PROT_WRITE,
+                             MAP_SHARED, indices, 0);
+    if (data == MAP_FAILED) abort_mapping("Unable to map scratch file into memory");
+    positions = static_cast<std::size_t*>(data);
+  }
+
+  auto peak = std::size_t{0};
+  for (auto layer = 0u; layer < nodes.size(); ++layer) {
+    if (verbose)
+      std::cout << progress_bar("Sorting nodes", layer, nodes.size()) << std::flush;
+    peak = std::max(peak, layer == 0 ?
+      sort_spilled_layer(descriptor, base, runs, positions, leaves, nodes[0], memory) :
+      sort_spilled_layer(descriptor, base, runs, positions, nodes[layer-1], nodes[layer], memory));
+  }
+  if (positions)
+    ::munmap(positions, largest*sizeof(std::size_t));
+  ::close(indices);
+  ::close(runs);
+  ::close(descriptor);
+
+  if (verbose)
+    std::cout << "\rSorting nodes: done." << spaces(100) << '\n';
+  return peak;
+}
+
+/******************************************************************************
+ * class spill_file:
+ *  Temporary file to which data is appended, and which is mapped read-only
+ *  once complete.
+ */
+spill_file::spill_file() {
+  auto path = (std::filesystem::temp_directory_path() / "shared_tree.XXXXXX").string();
+  descriptor = ::mkstemp(path.data());
+  if (descriptor < 0) abort_mapping("Unable to create spill file");
+  ::unlink(path.c_str());
+}
+
+spill_file::~spill_file() {
+  if (descriptor >= 0) ::close(descriptor);
+}
+
+void spill_file::write(const void* data, std::size_t bytes) {
+  write_at(descriptor, data, bytes, size);
+  size += bytes;
+}
+
+/**
+ * Maps the data written so far, and closes the file. The file is removed once
+ * the mapping is released.
+ * Precondition: data has been written
+ */
+auto spill_file::map() -> std::shared_ptr<const void> {
+  const auto data = ::mmap(nullptr, size, PROT_READ, MAP_SHARED, descriptor, 0);
+  ::close(descriptor);
+  descriptor = -1;
+  if (data == MAP_FAILED) abort_mapping("Unable to map spill file into memory");
+  return std::shared_ptr<const void>{data,
+    [size = size](const void* data) { ::munmap(const_cast<void*>(data), size); }};
+}
+
+/******************************************************************************
+ * class indexed_tree:
+ *  Read-only view of a shared tree in the indexed DAG format, decoding nodes
+ *  straight from the mapped file.
+ */
+/**
+ * Maps a file in the indexed DAG format, which takes constant time apart from
+ * reading the records section.
+ */
+indexed_tree::indexed_tree(std::filesystem::path path) {
+  auto [file, size, header] = map_archive(path, indexed_magic, shared_tree::indexed_version);
+  const auto bytes = static_cast<const char*>(file.get());
+  if (!valid_array(header.leaf_offset, header.leaf_count, dna::bytes(), size))
+    abort_mapping("DAG file is corrupt");
+
+  mapping = file;
+  root = mapped_pointer(header.root);
+  leaves = reinterpret_cast<const unsigned char*>(bytes + header.leaf_offset);
+  leaf_total = header.leaf_count;
+  for (auto layer = 0u; layer < header.layers; ++layer) {
+    const auto entry = mapped_entry(bytes, layer);
+    const auto samples = sample_count(entry.count);
+    if (!valid_array(entry.offset, samples, sizeof(std::uint64_t), size)) abort_mapping("DAG file is corrupt");
+
+    const auto index = reinterpret_cast<const std::uint64_t*>(bytes + entry.offset);
+    const auto stream = entry.offset + samples*sizeof(std::uint64_t);
+    if (index[samples-1] > size - stream) abort_mapping("DAG file is corrupt");
+    layers.emplace_back(encoded_layer{index, reinterpret_cast<const unsigned char*>(bytes + stream), entry.count});
+  }
+  sequences = mapped_records(bytes, size, header);
+}
+
+/**
+ * Returns the leaf with index <index>, without applying any transformations.
+ */
+auto indexed_tree::leaf(std::size_t index) const noexcept -> dna {
+  const auto bytes = dna::bytes();
+  const auto start = leaves + index*bytes;
+  auto value = std::uint64_t{0};
+  for (auto i = 0u; i < bytes; ++i) value = value << 8 | start[i];
+  return dna{value};
+}
+
+auto indexed_tree::access_leaf(pointer pointer) const -> dna {
+  auto result = leaf(pointer.index());
+  if (pointer.is_mirrored()) result = result.mirrored();
+  if (pointer.is_transposed()) result = result.transposed();
+  return result;
+}
+
+/**
+ * Decodes the node in layer <layer> pointed to by <pointer>. Starts at the
+ * nearest preceding sample and skips the pointers in between, of which only
+ * the first byte has to be inspected.
+ */
+auto indexed_tree::access_node(std::size_t layer, pointer pointer) const -> node {
+  const auto& encoded = layers[layer];
+  const auto index = pointer.index();
+  auto cursor = encoded.stream + encoded.samples[index / sample_rate];
+  for (auto skip = 2*(index % sample_rate); skip > 0; --skip) cursor += encoded_bytes(cursor);
+  const auto left = decode_pointer(cursor);
+  const auto right = decode_pointer(cursor);
+  return node{left, right};
+}
+
+auto indexed_tree::children(std::size_t layer, pointer pointer) const -> std::size_t {
+  if (pointer.empty()) return 0;
+  const auto node = access_node(layer, pointer);
+  if (layer == 0) return !node.left().empty() + !node.right().empty();
+  else return children(layer-1, node.left()) + children(layer-1, node.right());
+}
+
+/**
+ * Indexing operator into the tree, as shared_tree::operator[].
+ * Precondition: index < width
+ */
+auto indexed_tree::operator[](std::uint64_t index) const -> dna {
+  auto current = root;
+  for (int layer = layers.size()-1; layer >= 0; --layer) {
+    const auto node = access_node(layer, current);
+    const auto size = std::uint64_t{1} << layer;
+    const auto right = index >= size;
+    if (right) index -= size;
+    const auto next = (right != current.is_mirrored()) ? node.right() : node.left();
+    current = pointer{next, current.is_mirrored(), current.is_transposed()};
+  }
+  return access_leaf(current);
+}
+
+/**
+ * Decodes the whole tree into memory.
+ */
+auto indexed_tree::expand() const -> shared_tree {
+  auto result = shared_tree{};
+  result.root = root;
+  result.sequences = sequences;
+  result.leaves.reserve(leaf_total);
+  for (auto i = 0u; i < leaf_total; ++i) result.leaves.emplace_back(leaf(i));
+
+  for (const auto& encoded : layers) {
+    auto& layer = result.nodes.emplace_back().elements();
+    layer.reserve(encoded.count);
+    auto cursor = encoded.stream;
+    for (auto i = 0u; i < encoded.count; ++i) {
+      const auto left = decode_pointer(cursor);
+      const auto right = decode_pointer(cursor);
+      layer.emplace_back(left, right);
+    }
+  }
+  return result;
+}
+
+/******************************************************************************
+ * class shared_tree::iterator:
+ *  Iterator over the tree.
+ */
+shared_tree::iterator::iterator(shared_tree& parent, std::size_t layer, pointer root) : parent{parent} {
+  if (root) {
+    stack.emplace_back(layer, root);
+    next_leaf();
+  }
+}
+
+/**
+ * Returns the DNA strand stored in the current leaf.
+ * Mirrors and transposes it, if necessary.
+ * Precondition: current stack top points to a leaf.
+ */
+auto shared_tree::iterator::operator*() const noexcept -> dna {
+  auto top = stack.back().current;
+  return parent.access_leaf(top);
+}
+
+/**
+ *  Advances the iterator to the first leaf on the right of the current leaf.
+ *  To achieve this, pops the last-found leaf off the stack and recurses on the
+ *  remaining stack members until a leaf is found.
+ */
+auto shared_tree::iterator::operator++() -> iterator& {
+  stack.pop_back();
+  next_leaf();
+  return *this;
+}
+
+/**
+ *  Iterates over the tree nodes until a leaf is found, or the stack is empty.
+ *  For each encountered node, determines if it is a leaf. If not, its children
+ *  are added to the stack and we apply the same procedure to them, starting
+ *  with the left child.
+ */
+void shared_tree::iterator::next_leaf() {
+  while (!stack.empty()) {
+    auto status = stack.back();
+    // Leaf level is indicated as the maximum std::size_t value
+    if (status.layer == std::numeric_limits<std::size_t>::max()) return;
+
+    auto top = status.current;
+    auto node = parent.access_node(status.layer, status.current);
+    stack.pop_back();
+
+    // Apply mirroring and transposition, if necessary, and save the resulting
+    // state on the stack.
     auto stack_push = [&](auto next) {
         auto mirror = top.is_mirrored();
         auto transpose = top.is_transposed();
@@ -618,9 +2020,36 @@ void shared_tree::iterator::next_leaf() {
  *  Helper class in construction of a balanced shared tree.
  *  Contains the maps used to link nodes to pointers or leaves.
  */
-tree_constructor::tree_constructor(shared_tree& parent)
-: parent{parent} {
-  nodes.reserve(64);
+tree_constructor::tree_constructor(shared_tree& parent, unsigned threads, std::size_t memory, bool compact)
+: parent{parent}, threads{std::max(threads, 1u)}, memory{memory}, compact{compact} {}
+
+/**
+ * Compacts the maps that are saturated, if requested, and then spills the
+ * largest maps to disk until the payload bytes of all maps fit within the
+ * memory budget, if one was given. Called after every segment.
+ */
+void tree_constructor::manage_maps() {
+  if (compact) {
+    if (leaves.is_saturated()) leaves.compact();
+    for (auto& map : nodes)
+      if (map.is_saturated()) map.compact();
+  }
+  if (memory == 0) return;
+
+  while (true) {
+    auto total = leaves.payload_bytes();
+    auto largest = (leaves.resident() == 0) ? 0 : leaves.payload_bytes();
+    auto spill = std::function<void()>{[&] { leaves.spill(); }};
+    for (auto& map : nodes) {
+      total += map.payload_bytes();
+      if (map.resident() > 0 && map.payload_bytes() > largest) {
+        largest = map.payload_bytes();
+        spill = [&map] { map.spill(); };
+      }
+    }
+    if (total <= memory || largest == 0) return;
+    spill();
+  }
 }
 
 /**
@@ -629,13 +2058,24 @@ tree_constructor::tree_constructor(shared_tree& parent)
  */
 auto tree_constructor::emplace_leaf(dna leaf) -> pointer {
   const auto [canonical, mirror, transpose, invariant] = leaf.canonical();
-  const auto insertion = leaves.emplace(canonical, parent.leaf_count());
-  const auto index = (*insertion.first).second;
+  const auto [index, inserted] = leaves.find_or_insert(canonical, next_leaf());
 
-  if (insertion.second) parent.emplace_leaf(canonical);
+  if (inserted) parent.emplace_leaf(canonical);
   return pointer{index, mirror, transpose, invariant};
 }
 
+/**
+ * Inserts a leaf that has already been canonicalised, with the
+ * transformations to obtain it as given by batched canonicalisation.
+ */
+auto tree_constructor::emplace_canonical_leaf(dna canonical, std::uint8_t transforms) -> pointer {
+  const auto [index, inserted] = leaves.find_or_insert(canonical, next_leaf());
+
+  if (inserted) parent.emplace_leaf(canonical);
+  return pointer{index, bool(transforms & dna::mirror_bit),
+    bool(transforms & dna::transpose_bit), bool(transforms & dna::invariant_bit)};
+}
+
 /**
  * Emplaces leaves into the leaf map, if necessary, and adds a node referencing
  * them to the first non-leaf layer.
@@ -657,36 +2097,331 @@ auto tree_constructor::emplace_leaves(dna last) -> pointer {
 
 /**
  * Constructs and emplaces a node inside the tree during its construction.
- * Returns a pointer to this node.
+ * Returns a pointer to this node. Nodes of the base are pointed to as they
+ * are stored there, both by the result and by <left> and <right>, while the
+ * maps are keyed on their canonical form.
  */
 auto tree_constructor::emplace_node(std::size_t layer, pointer left, pointer right) -> pointer
 {
-  const auto created_node = node{left, right};
+  const auto created_node = base_children(layer, node{left, right});
   const auto [canonical_node, mirror, transpose] = created_node.canonical();
-  const auto insertion = nodes[layer].emplace(canonical_node, parent.node_count(layer));
-  if (insertion.second) parent.emplace_node(layer, canonical_node);
-  const auto index = (*insertion.first).second;
+  const auto [index, inserted] = nodes[layer].find_or_insert(canonical_node, next_node(layer));
+  if (inserted) parent.emplace_node(layer, base_children(layer, canonical_node));
 
-  const auto invariant = (left == right.mirrored());
-  return pointer{index, mirror, transpose, invariant};
+  const auto invariant = (created_node.left() == created_node.right().mirrored());
+  return base_pointer(layer, pointer{index, mirror, transpose, invariant});
+}
+
+/**
+ * Converts <target>, pointing to a node in <layer>, between the canonical form
+ * of that node, on which the maps are keyed, and the form in which the base
+ * stores it, if it is a node of the base. The conversion works both ways, as
+ * the transformations are their own inverse.
+ */
+auto tree_constructor::base_pointer(std::size_t layer, pointer target) const -> pointer {
+  if (!target || layer >= base_nodes.size() || target.index() >= base_nodes[layer]) return target;
+  return transformed(target, base_transforms[layer][target.index()]);
+}
+
+/**
+ * Converts the children of <created>, a node in <layer>, as base_pointer()
+ * does. Leaves are stored in canonical form, so only nodes above the first
+ * layer have children to convert.
+ */
+auto tree_constructor::base_children(std::size_t layer, const node& created) const -> node {
+  if (layer == 0) return created;
+  return node{base_pointer(layer-1, created.left()), base_pointer(layer-1, created.right())};
 }
 
 /**
  * Reduces all gathered root nodes in order to fully reduce the tree.
+ * The roots only add nodes to new layers, so the maps of all current layers
+ * are released first, unless <release> is false because further input is
+ * still to be deduplicated against them. Afterwards, the constructor is ready
+ * to reduce the next input into the same tree.
  */
-auto tree_constructor::reduce_roots(bool verbose) -> pointer {
+auto tree_constructor::reduce_roots(bool verbose, bool release) -> pointer {
+  if (release) {
+    leaves.release();
+    for (auto& map : nodes) map.release();
+  }
+
   const auto size = log2(roots.size());
   auto i = 0;
-  for (auto index = nodes.size(); roots.size() > 1; ++index, ++i) {
+  auto index = segment_depth;
+  for (; roots.size() > 1; ++index, ++i) {
     roots = reduce_nodes(roots, index);
     if (verbose)
       std::cout << progress_bar("Combining subtrees", i, size) << std::flush;
   }
 
-  if (verbose)
+  if (verbose) {
     std::cout << "\rCombining subtrees: done." << spaces(100) << '\n';
+    print_hit_rates();
+  }
 
-  return roots.front();
+  const auto root = roots.front();
+  top = index - 1;
+  roots.clear();
+  segment_depth = 0;
+  return root;
+}
+
+/**
+ * Indexes the leaves and nodes that the tree already holds, such as those of
+ * a loaded tree, so that further input is deduplicated against them. The
+ * tree must be in canonical form, see shared_tree::canonicalise().
+ */
+void tree_constructor::index_tree(bool verbose) {
+  const auto total = parent.depth();
+  for (auto i = 0ul; i < parent.leaf_count(); ++i)
+    leaves.find_or_insert(parent.access_leaf(pointer{i, false, false, false}), i);
+  manage_maps();
+
+  for (auto layer = nodes.size(); layer + 1 < parent.depth(); ++layer) {
+    if (verbose)
+      std::cout << progress_bar("Indexing tree", layer+1, total) << std::flush;
+    auto& map = nodes.emplace_back();
+    for (auto i = 0ul; i < parent.node_count(layer); ++i)
+      map.find_or_insert(parent.access_node(layer, pointer{i, false, false, false}), i);
+    manage_maps();
+  }
+
+  if (verbose)
+    std::cout << "\rIndexing tree: done." << spaces(100) << '\n';
+}
+
+/**
+ * Header of the file holding a persisted base index, followed by a table with
+ * the number of elements of every level, from the leaves up, and the offsets
+ * of their run and transformations. The base is identified by its DNA size
+ * and the size and modification time of its file, so that an index that no
+ * longer matches its base is rebuilt. All fields are stored in little-endian
+ * byte order.
+ */
+constexpr auto base_index_magic = std::array<char, 8>{'S', 'H', 'T', 'B', 'I', 'X', '\r', '\n'};
+
+struct base_index_header {
+  std::array<char, 8> magic;
+  std::uint32_t version;
+  std::uint32_t dna_size;
+  std::uint64_t base_size;
+  std::int64_t base_time;
+  std::uint64_t levels;
+};
+
+struct base_index_level {
+  std::uint64_t count;
+  std::uint64_t entries;
+  std::uint64_t transforms;
+};
+
+/**
+ * Returns the header identifying the base archive at <archive>.
+ */
+auto base_fingerprint(std::filesystem::path archive, std::size_t levels) {
+  auto error = std::error_code{};
+  const auto size = std::filesystem::file_size(archive, error);
+  const auto time = std::filesystem::last_write_time(archive, error);
+  return base_index_header{base_index_magic, base_index::version, std::uint32_t(dna::size()),
+    error ? 0 : std::uint64_t(size), error ? 0 : std::int64_t(time.time_since_epoch().count()), levels};
+}
+
+/**
+ * Runs of a base index that are held in memory rather than mapped.
+ */
+struct base_index_runs {
+  std::vector<striped_map<dna>::spilled_entry> leaves;
+  std::vector<std::vector<striped_map<node>::spilled_entry>> nodes;
+  std::vector<std::vector<std::uint8_t>> transforms;
+};
+
+/**
+ * Builds the index of <base> in memory.
+ */
+base_index::base_index(const shared_tree& base) : base{base} {
+  build(false);
+}
+
+/**
+ * Maps the index of <base>, which was loaded from <archive>, from the file
+ * next to it. If there is none, or it does not match the base, the index is
+ * built and persisted, and then mapped.
+ */
+base_index::base_index(const shared_tree& base, std::filesystem::path archive, bool verbose) : base{base} {
+  if (load(archive)) return;
+  build(verbose);
+  if (has_mapped_layout() && persist(archive)) load(archive);
+}
+
+/**
+ * Builds the runs of the index in memory. Leaves are stored canonically, so
+ * their run is keyed on the leaves as stored. Nodes are canonicalised layer by
+ * layer, as the base may have been sorted.
+ */
+void base_index::build(bool verbose) {
+  auto runs = std::make_shared<base_index_runs>();
+  const auto total = base.depth();
+  for (auto i = 0ul; i < base.leaf_count(); ++i) runs->leaves.push_back({base.leaves[i], i});
+  std::sort(runs->leaves.begin(), runs->leaves.end(),
+    [](const auto& a, const auto& b) { return a.key < b.key; });
+
+  auto transforms = leaf_transforms(base.leaves);
+  for (auto layer = 0ul; layer + 1 < base.depth(); ++layer) {
+    if (verbose)
+      std::cout << progress_bar("Indexing base", layer+1, total) << std::flush;
+    auto& entries = runs->nodes.emplace_back();
+    entries.reserve(base.node_count(layer));
+    transforms = canonicalise_layer(base.nodes[layer], transforms,
+      [&](auto i, auto canonical) { entries.push_back({canonical, i}); });
+    std::sort(entries.begin(), entries.end(), [](const auto& a, const auto& b) { return a.key < b.key; });
+    runs->transforms.push_back(transforms);
+  }
+
+  leaves = run<dna>{runs->leaves.data(), runs->leaves.size(), nullptr};
+  nodes.clear();
+  for (auto layer = 0ul; layer < runs->nodes.size(); ++layer)
+    nodes.push_back(run<node>{runs->nodes[layer].data(), runs->nodes[layer].size(), runs->transforms[layer].data()});
+  storage = std::move(runs);
+  mapped = false;
+
+  if (verbose)
+    std::cout << "\rIndexing base: done." << spaces(100) << '\n';
+}
+
+/**
+ * Writes the runs of the index next to <archive>, through a temporary file
+ * that is renamed into place, so that concurrent processes never map a
+ * partially written index. Returns whether the index was written.
+ */
+auto base_index::persist(std::filesystem::path archive) const -> bool {
+  auto header = base_fingerprint(archive, nodes.size() + 1);
+  auto table = std::vector<base_index_level>(header.levels);
+  auto offset = align_mapped(sizeof(header) + table.size()*sizeof(base_index_level));
+  table[0] = base_index_level{leaves.count, offset, 0};
+  offset = align_mapped(offset + leaves.count*sizeof(*leaves.entries));
+  for (auto layer = 0ul; layer < nodes.size(); ++layer) {
+    table[layer+1] = base_index_level{nodes[layer].count, offset, 0};
+    offset = align_mapped(offset + nodes[layer].count*sizeof(*nodes[layer].entries));
+    table[layer+1].transforms = offset;
+    offset = align_mapped(offset + nodes[layer].count);
+  }
+
+  const auto target = path(archive);
+  auto temporary = target;
+  temporary += ".tmp" + std::to_string(::getpid());
+  {
+    auto file = archive_writer{temporary};
+    file.write(&header, sizeof(header));
+    file.write(table.data(), table.size()*sizeof(base_index_level));
+    file.pad();
+    file.write(leaves.entries, leaves.count*sizeof(*leaves.entries));
+    for (const auto& run : nodes) {
+      file.pad();
+      file.write(run.entries, run.count*sizeof(*run.entries));
+      file.pad();
+      file.write(run.transforms, run.count);
+    }
+    file.stream.close();
+    if (file.stream) {
+      auto error = std::error_code{};
+      std::filesystem::rename(temporary, target, error);
+      if (!error) return true;
+    }
+  }
+  auto error = std::error_code{};
+  std::filesystem::remove(temporary, error);
+  return false;
+}
+
+/**
+ * Maps the index persisted next to <archive>, and returns whether it matches
+ * the base. The runs then refer directly to the mapped file.
+ */
+auto base_index::load(std::filesystem::path archive) -> bool {
+  if (!has_mapped_layout()) return false;
+  auto [mapping, size] = map_file(path(archive));
+  if (!mapping || size < sizeof(base_index_header)) return false;
+  const auto bytes = static_cast<const char*>(mapping.get());
+
+  auto header = base_index_header{};
+  std::memcpy(&header, bytes, sizeof(header));
+  const auto expected = base_fingerprint(archive, base.depth());
+  if (header.magic != expected.magic || header.version != expected.version
+      || header.dna_size != expected.dna_size || header.base_size != expected.base_size
+      || header.base_time != expected.base_time || header.levels != expected.levels
+      || header.levels > (size - sizeof(header)) / sizeof(base_index_level))
+    return false;
+
+  auto table = std::vector<base_index_level>(header.levels);
+  std::memcpy(table.data(), bytes + sizeof(header), table.size()*sizeof(base_index_level));
+  if (table[0].count != base.leaf_count()
+      || !valid_array(table[0].entries, table[0].count, sizeof(*leaves.entries), size))
+    return false;
+  for (auto layer = 0ul; layer + 1 < table.size(); ++layer) {
+    const auto& level = table[layer+1];
+    if (level.count != base.node_count(layer)
+        || !valid_array(level.entries, level.count, sizeof(striped_map<node>::spilled_entry), size)
+        || !valid_array(level.transforms, level.count, 1, size))
+      return false;
+  }
+
+  leaves = run<dna>{reinterpret_cast<decltype(leaves.entries)>(bytes + table[0].entries), table[0].count, nullptr};
+  nodes.clear();
+  for (auto layer = 0ul; layer + 1 < table.size(); ++layer) {
+    const auto& level = table[layer+1];
+    nodes.push_back(run<node>{reinterpret_cast<const striped_map<node>::spilled_entry*>(bytes + level.entries),
+      level.count, reinterpret_cast<const std::uint8_t*>(bytes + level.transforms)});
+  }
+  storage = std::move(mapping);
+  mapped = true;
+  return true;
+}
+
+/**
+ * Attaches the runs of <base> to the maps, without adding its leaves and
+ * nodes to the tree, so that the input is deduplicated against them and the
+ * tree only holds what the input adds to the base. The tree must be empty.
+ * The runs are only read, and looked up by key in the canonical form of each
+ * node; the transformations to obtain the form the base stores are kept.
+ */
+void tree_constructor::index_base(const base_index& base) {
+  assert(parent.depth() == 1 && parent.leaf_count() == 0);
+  base_leaves = base.leaves.count;
+  leaves.attach(base.storage, base.leaves.entries, base.leaves.count);
+  for (const auto& run : base.nodes) {
+    parent.add_layer();
+    nodes.emplace_back().attach(base.storage, run.entries, run.count);
+    base_nodes.push_back(run.count);
+    base_transforms.push_back(run.transforms);
+  }
+}
+
+/**
+ * Pads <root>, which lies in <layer>, with nodes that only have a left child
+ * up to the top layer of the tree, and returns the padded root. The padded
+ * root covers the same leaves, so that trees of different depths can share
+ * the top layer.
+ */
+auto tree_constructor::raise(pointer root, std::size_t layer) -> pointer {
+  for (++layer; layer < nodes.size(); ++layer) root = emplace_node(layer, root);
+  return root;
+}
+
+/**
+ * Prints the share of lookups in each map that found an existing entry.
+ */
+void tree_constructor::print_hit_rates() const {
+  auto print = [](const std::string& name, const auto& map) {
+    const auto lookups = map.lookup_count();
+    const auto rate = (lookups == 0) ? 0.0 : std::round(1e4*double(map.hit_count())/double(lookups))/100;
+    std::cout << ' ' << name << spaces(26 - name.size()) << rate << "% of " << lookups << " lookups\n";
+  };
+
+  std::cout << "\nHit rates of the node maps:\n";
+  print("Leaves:", leaves);
+  for (auto layer = 0u; layer < nodes.size(); ++layer)
+    print("Layer " + std::to_string(layer) + ':', nodes[layer]);
 }
 
 /**
@@ -715,24 +2450,36 @@ auto tree_constructor::reduce_nodes(const std::vector<pointer>& iterable, std::s
  * Reduces data read from a file into segments, each of which is fully reduced.
  * The resulting subtree roots are then accumulated into a single top layer
  * which is also reduced to complete the tree.
+ * When multiple threads are available, one buffer per thread is read and the
+ * resulting batch of segments is reduced concurrently.
  */
-auto tree_constructor::reduce(fasta_reader& file, bool verbose) -> pointer {
-  std::vector<dna> buffer;
+auto tree_constructor::reduce(fasta_reader& file, bool verbose, bool release) -> pointer {
+  auto buffers = std::vector<std::vector<dna>>(threads);
   auto current_buffer = 0;
   const auto approximate_buffer_count = file.buffers();
-  while (file.read_into(buffer)) {
-    reduce_segment(buffer);
+  while (true) {
+    auto count = 0u;
+    while (count < threads && file.read_into(buffers[count])) ++count;
+    if (count == 0) break;
+
+    if (threads == 1) reduce_segment(buffers.front());
+    else {
+      buffers.resize(count);
+      reduce_segments(buffers);
+    }
+    manage_maps();
 
     if (verbose) {
-      ++current_buffer;
+      current_buffer += count;
       std::cout << progress_bar("Constructing subtrees", current_buffer, approximate_buffer_count) << std::flush;
     }
+    if (count < threads) break;
   }
 
   if (verbose)
     std::cout << "\rConstructing subtrees: done." << spaces(100) << '\n';
 
-  return reduce_roots(verbose);
+  return reduce_roots(verbose, release);
 }
 
 /**
@@ -740,24 +2487,45 @@ auto tree_constructor::reduce(fasta_reader& file, bool verbose) -> pointer {
  * reduced. The resulting tree roots are then also reduced to obtain the
  * final tree representation.
  */
-auto tree_constructor::reduce(const std::vector<dna>& data, bool verbose) -> pointer {
+auto tree_constructor::reduce(const std::vector<dna>& data, bool verbose, bool release) -> pointer {
   constexpr auto subtree_depth = 25;
   constexpr auto subtree_width = (1u<<subtree_depth);
 
   auto current_subtree = 0;
   const auto subtrees = data.size() / subtree_width;
 
-  for (auto segment : chunks(data, subtree_width)) {
-    reduce_segment(segment);
-    
-    if (verbose) {
-      ++current_subtree;
-      std::cout << progress_bar("Constructing subtrees", current_subtree, subtrees) << std::flush;
+  if (threads == 1) {
+    for (auto segment : chunks(data, subtree_width)) {
+      reduce_segment(segment);
+      manage_maps();
+
+      if (verbose) {
+        ++current_subtree;
+        std::cout << progress_bar("Constructing subtrees", current_subtree, subtrees) << std::flush;
+      }
+    }
+  } else {
+    using segment = decltype(iterator_pair(data.data(), data.data()));
+    auto batch = std::vector<segment>{};
+    for (auto begin = 0ul; begin < data.size(); ) {
+      batch.clear();
+      while (batch.size() < threads && begin < data.size()) {
+        const auto end = std::min<std::size_t>(begin + subtree_width, data.size());
+        batch.emplace_back(data.data() + begin, data.data() + end);
+        begin = end;
+      }
+      reduce_segments(batch);
+      manage_maps();
+
+      if (verbose) {
+        current_subtree += batch.size();
+        std::cout << progress_bar("Constructing subtrees", current_subtree, subtrees) << std::flush;
+      }
     }
   }
 
   if (verbose)
     std::cout << "\rConstructing subtrees: done." << spaces(100) << '\n';
   
-  return reduce_roots(verbose);
+  return reduce_roots(verbose, release);
 }
\ No newline at end of file
@@ -0,0 +1,159 @@
+/**
+ *  Choice of the number of nucleotides per leaf from samples of the input.
+ */
+
+#include "size_tuner.h"
+#include "dna.h"
+#include "fasta_reader.h"
+#include "shared_tree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <unistd.h>
+
+/**
+ * Samples <windows> windows that together span about <sample_size> bytes,
+ * spread evenly over the FASTA files at <paths>. Each file gets a share of the
+ * windows and of the sample size in proportion to its size. Windows are cut
+ * at line boundaries and header lines are dropped. Inputs smaller than the
+ * sample size are sampled as a whole.
+ */
+size_tuner::size_tuner(const std::vector<std::filesystem::path>& paths, std::uint64_t sample_size, std::size_t windows) {
+  auto total = std::uint64_t{0};
+  for (const auto& path : paths) {
+    if (!std::filesystem::is_regular_file(path)) {
+      std::cerr << "Unable to open file, aborting...\n";
+      exit(1);
+    }
+    total += std::filesystem::file_size(path);
+  }
+
+  auto count = std::size_t{0};
+  for (const auto& path : paths) {
+    const auto share = (total == 0) ? 0.0 : double(std::filesystem::file_size(path)) / total;
+    const auto file_windows = std::max<std::size_t>(std::lround(share*windows), 1);
+    add_windows(path, (total <= sample_size) ? total : std::uint64_t(share*sample_size), file_windows, count);
+  }
+
+  if (!sample.empty()) scale = std::max(1.0, double(total) / sample.size());
+}
+
+/**
+ * Adds <windows> windows that together span about <sample_size> bytes, spread
+ * evenly over the FASTA file at <path>, to the sample. Every other window, as
+ * counted by <count> over all files, is added to the half sample as well.
+ */
+void size_tuner::add_windows(const std::filesystem::path& path, std::uint64_t sample_size, std::size_t windows,
+                             std::size_t& count) {
+  auto file = std::ifstream{path, std::ios::binary};
+  if (!file.is_open()) {
+    std::cerr << "Unable to open file, aborting...\n";
+    exit(1);
+  }
+
+  const auto size = std::filesystem::file_size(path);
+  windows = (size <= sample_size) ? 1 : std::max<std::size_t>(windows, 2);
+  const auto window_size = std::min<std::uint64_t>(size, sample_size / windows);
+
+  auto window = std::string{};
+  for (auto i = 0ul; i < windows; ++i, ++count) {
+    const auto offset = (windows == 1) ? 0 : i * (size - window_size) / (windows - 1);
+    window.resize(window_size);
+    file.seekg(offset);
+    file.read(window.data(), window.size());
+    window.resize(file.gcount());
+    file.clear();
+
+    // Cut the window at line boundaries where it has any, so that partial
+    // header lines are recognised.
+    auto begin = std::size_t{0};
+    auto end = window.size();
+    if (const auto first = window.find('\n'); offset != 0 && first != std::string::npos) begin = first + 1;
+    if (const auto last = window.rfind('\n'); offset + window.size() != size && last != std::string::npos
+        && last >= begin) end = last;
+
+    auto lines = std::string{};
+    while (begin < end) {
+      const auto next = std::min(window.find('\n', begin), end);
+      if (window[begin] != '>') lines.append(window, begin, next - begin).push_back('\n');
+      begin = next + 1;
+    }
+    sample += lines;
+    if (count % 2 == 0) half += lines;
+  }
+}
+
+/**
+ * Compresses <text> as a single headerless record at the current DNA size,
+ * and returns the size of the resulting tree together with the time it took.
+ */
+auto size_tuner::measure(const std::string& text, unsigned threads) const -> measurement {
+  auto path = (std::filesystem::temp_directory_path() / "size_tuner.XXXXXX").string();
+  const auto descriptor = ::mkstemp(path.data());
+  if (descriptor < 0) {
+    std::cerr << "Unable to create sample file, aborting...\n";
+    exit(1);
+  }
+  ::close(descriptor);
+  {
+    auto file = std::ofstream{path, std::ios::binary};
+    file << text;
+  }
+
+  const auto start = std::chrono::high_resolution_clock::now();
+  auto tree = shared_tree{fasta_reader{path}, false, threads};
+  tree.sort_tree(false, threads);
+  const auto end = std::chrono::high_resolution_clock::now();
+  std::filesystem::remove(path);
+  return measurement{tree.bytes(), end - start};
+}
+
+/**
+ * Estimates the compressed size and the compression time of the whole input
+ * at <dna_size> nucleotides per leaf. Deduplication makes the size grow less
+ * than linearly with the input, so the size is extrapolated along the power
+ * law through the sizes of the sample and of its half. The time is
+ * extrapolated linearly.
+ */
+auto size_tuner::evaluate(std::size_t dna_size, unsigned threads) const -> estimate {
+  if (sample.empty()) return estimate{dna_size, 0, std::chrono::milliseconds{0}};
+  const auto previous = dna::size();
+  dna::size(dna_size);
+  const auto full = measure(sample, threads);
+  auto exponent = 1.0;
+  if (scale > 1 && !half.empty() && half.size() < sample.size()) {
+    const auto partial = measure(half, threads);
+    if (partial.bytes > 0 && full.bytes > partial.bytes)
+      exponent = std::log(double(full.bytes) / partial.bytes) / std::log(double(sample.size()) / half.size());
+    else
+      exponent = 0;
+  }
+  dna::size(previous);
+
+  const auto bytes = full.bytes * std::pow(scale, std::clamp(exponent, 0.0, 1.0));
+  const auto time = full.time * scale;
+  return estimate{dna_size, std::uint64_t(bytes), std::chrono::duration_cast<std::chrono::milliseconds>(time)};
+}
+
+auto size_tuner::evaluate(const std::vector<std::size_t>& dna_sizes, unsigned threads) const -> std::vector<estimate> {
+  auto estimates = std::vector<estimate>{};
+  for (const auto size : dna_sizes) estimates.push_back(evaluate(size, threads));
+  return estimates;
+}
+
+/**
+ * Returns the estimate that minimises bytes * time^<time_weight>. A weight of
+ * zero picks the smallest output regardless of time; a weight of one trades a
+ * relative gain in size evenly against the same relative loss in time.
+ */
+auto size_tuner::choose(const std::vector<estimate>& estimates, double time_weight) -> estimate {
+  auto score = [&](const estimate& estimate) {
+    const auto milliseconds = std::max<double>(estimate.time.count(), 1);
+    return std::log(std::max<double>(estimate.bytes, 1)) + time_weight * std::log(milliseconds);
+  };
+  return *std::min_element(estimates.begin(), estimates.end(),
+    [&](const auto& a, const auto& b) { return score(a) < score(b); });
+}
@@ -0,0 +1,472 @@
+/**
+ *  Microbenchmarks for the performance-critical parts of the implementation.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+#include "shared_tree.h"
+#include "dna.h"
+#include "fasta_reader.h"
+#include "utility.h"
+
+#define BENCHMARK_START(name) \
+    std::cout << "\n============================================================\n" \
+      << " " << name << '\n' \
+      << "============================================================\n";
+
+/**
+ * Returns the time taken by a single invocation of <func>, in seconds.
+ */
+template<typename Func>
+auto measure(Func&& func) -> double {
+  const auto start = std::chrono::high_resolution_clock::now();
+  func();
+  const auto end = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double>(end - start).count();
+}
+
+/**
+ * Measures the throughput of concurrent node insertion into a single striped
+ * layer map against the number of threads inserting.
+ * The keys are drawn with repetition, so that both hits and misses occur.
+ */
+void benchmark_striped_map() {
+  BENCHMARK_START("Striped map insertion");
+
+  constexpr auto key_count = 1ul << 22;
+  constexpr auto distinct = 1ul << 20;
+  auto generator = std::mt19937_64{42};
+  auto distribution = std::uniform_int_distribution<std::size_t>{0, distinct-1};
+  auto keys = std::vector<node>{};
+  keys.reserve(key_count);
+  for (auto i = 0ul; i < key_count; ++i) {
+    const auto left = distribution(generator);
+    const auto right = distribution(generator) % 16;
+    keys.emplace_back(pointer{left, false, false, false}, pointer{right, false, false, false});
+  }
+
+  {
+    auto map = striped_map<node>{};
+    const auto seconds = measure([&] {
+      for (auto i = 0ul; i < key_count; ++i) map.find_or_insert(keys[i], i);
+    });
+    std::cout << " Unlocked, 1 thread:        "
+      << std::setw(8) << key_count/seconds/1e6 << " Minserts/s\n";
+  }
+
+  const auto max_threads = std::max(1u, 2*std::thread::hardware_concurrency());
+  for (auto threads = 1u; threads <= max_threads; threads *= 2) {
+    auto map = striped_map<node>{};
+    const auto seconds = measure([&] {
+      parallel_for(threads, threads, [&](auto thread) {
+        const auto begin = thread*key_count/threads;
+        const auto end = (thread+1)*key_count/threads;
+        for (auto i = begin; i < end; ++i) map.claim(keys[i], i);
+      });
+    });
+    std::cout << " Striped, " << std::setw(3) << threads << " thread(s):     "
+      << std::setw(8) << key_count/seconds/1e6 << " Minserts/s\n";
+  }
+}
+
+/**
+ * Reference pointer layouts from before pointers were packed into one word: a
+ * 29-bit index and three bool bit-fields, which GCC and Clang pack into one
+ * storage unit. Some compilers, MSVC among them, do not share storage units
+ * between uint32_t and bool bit-fields; the second layout models that.
+ */
+struct bitfield_pointer {
+  std::uint32_t data : 29;
+  bool mirror : 1;
+  bool transpose : 1;
+  bool invariant : 1;
+};
+
+struct unshared_pointer {
+  std::uint32_t data;
+  bool mirror;
+  bool transpose;
+  bool invariant;
+};
+
+/**
+ * Reference node of two reference pointers, compared per pointer and hashed
+ * by combining the hashes of both, as nodes were before.
+ */
+template<typename Pointer>
+struct bitfield_node {
+  static auto to_ulong(const Pointer& p) noexcept -> unsigned long {
+    return p.data | (std::uint32_t)p.mirror << 29 | (std::uint32_t)p.transpose << 30;
+  }
+
+  bool operator==(const bitfield_node& other) const noexcept {
+    return to_ulong(left) == to_ulong(other.left) && to_ulong(right) == to_ulong(other.right);
+  }
+
+  struct hash {
+    auto operator()(const bitfield_node& n) const noexcept -> std::size_t {
+      const auto pointer_hash = robin_hood::hash<unsigned long>();
+      return detail::hash(pointer_hash(to_ulong(n.left)), pointer_hash(to_ulong(n.right)));
+    }
+  };
+
+  Pointer left;
+  Pointer right;
+};
+
+/**
+ * Compares the memory taken by nodes and layer maps, and the throughput of
+ * inserting nodes into a layer map, between the bit-field pointer layouts and
+ * the packed pointer word.
+ * The keys are drawn with repetition, so that both hits and misses occur.
+ */
+void benchmark_pointer_layout() {
+  BENCHMARK_START("Pointer layout");
+
+  constexpr auto key_count = 1ul << 22;
+  constexpr auto distinct = 1ul << 20;
+  auto generator = std::mt19937_64{42};
+  auto distribution = std::uniform_int_distribution<std::uint32_t>{0, distinct-1};
+  auto indices = std::vector<std::pair<std::uint32_t, std::uint32_t>>{};
+  indices.reserve(key_count);
+  for (auto i = 0ul; i < key_count; ++i)
+    indices.emplace_back(distribution(generator), distribution(generator) % 16);
+
+  auto report = [&](std::string_view name, std::size_t pointer_size, auto make_node, auto hash) {
+    using node_type = decltype(make_node(0u, 0u));
+    using hash_type = decltype(hash);
+    auto nodes = std::vector<node_type>{};
+    nodes.reserve(key_count);
+    for (const auto& [left, right] : indices) nodes.push_back(make_node(left, right));
+
+    auto map = phmap::flat_hash_map<node_type, std::size_t, hash_type>{};
+    const auto seconds = measure([&] {
+      for (auto i = 0ul; i < key_count; ++i) map.emplace(nodes[i], i);
+    });
+    const auto slot = sizeof(typename decltype(map)::value_type);
+    std::cout << ' ' << name << "pointer " << pointer_size << " B, node " << sizeof(node_type)
+      << " B, map slot " << slot << " B\n"
+      << "   layer of " << map.size() << " nodes: " << bytes_to_string(map.size()*sizeof(node_type))
+      << ", map " << bytes_to_string(map.capacity()*(slot + 1)) << ", "
+      << std::setw(8) << key_count/seconds/1e6 << " Minserts/s\n";
+  };
+
+  report("Bit-field, shared unit:    ", sizeof(bitfield_pointer), [](auto left, auto right) {
+    return bitfield_node<bitfield_pointer>{{left, false, false, false}, {right, false, false, false}};
+  }, bitfield_node<bitfield_pointer>::hash{});
+  report("Bit-field, separate units: ", sizeof(unshared_pointer), [](auto left, auto right) {
+    return bitfield_node<unshared_pointer>{{left, false, false, false}, {right, false, false, false}};
+  }, bitfield_node<unshared_pointer>::hash{});
+  report("Packed word:               ", sizeof(pointer), [](auto left, auto right) {
+    return node{pointer{left, false, false, false}, pointer{right, false, false, false}};
+  }, std::hash<node>{});
+}
+
+/**
+ * Reference implementation of strand parsing as a per-symbol std::toupper and
+ * switch, as used before the table-driven and vectorised parsers.
+ */
+auto parse_per_symbol(const char* strand) -> std::uint64_t {
+  auto value = std::uint64_t{0};
+  for (auto i = 0u; i < dna::size(); ++i) {
+    auto code = nac{};
+    switch (std::toupper(strand[i])) {
+      case 'A': code = nac::A; break;
+      case 'C': code = nac::C; break;
+      case 'G': code = nac::G; break;
+      case 'T': code = nac::T; break;
+      case 'R': code = nac::R; break;
+      case 'Y': code = nac::Y; break;
+      case 'K': code = nac::K; break;
+      case 'M': code = nac::M; break;
+      case 'S': code = nac::S; break;
+      case 'W': code = nac::W; break;
+      case 'B': code = nac::B; break;
+      case 'D': code = nac::D; break;
+      case 'H': code = nac::H; break;
+      case 'V': code = nac::V; break;
+      case 'N': code = nac::N; break;
+      default: code = nac::Indeterminate; break;
+    }
+    value |= static_cast<std::uint64_t>(code) << (4*i);
+  }
+  return value;
+}
+
+/**
+ * Measures the throughput of parsing FASTA symbols into DNA strands.
+ */
+void benchmark_parsing() {
+  BENCHMARK_START("FASTA parsing");
+
+  constexpr auto strands = 1ul << 22;
+  const auto symbols = std::string_view{"ACGTacgtNRYKMSWBDHV-"};
+  auto generator = std::mt19937_64{42};
+  auto text = std::string(strands*dna::size() + 16, 'A');
+  for (auto& symbol : text) symbol = symbols[generator() % 8];
+
+  auto checksum = std::uint64_t{0};
+  auto report = [&](std::string_view name, double seconds) {
+    std::cout << ' ' << name << std::setw(8) << strands*dna::size()/seconds/1e6 << " Mnt/s\n";
+  };
+
+  report("Per-symbol switch:         ", measure([&] {
+    for (auto i = 0ul; i < strands; ++i) checksum += parse_per_symbol(&text[i*dna::size()]);
+  }));
+
+  report("Lookup table:              ", measure([&] {
+    auto strand = dna{};
+    for (auto i = 0ul; i < strands; ++i) {
+      dna::parse(&text[i*dna::size()], strand);
+      checksum += strand;
+    }
+  }));
+
+  report("Vectorised:                ", measure([&] {
+    auto strand = dna{};
+    for (auto i = 0ul; i < strands; ++i) {
+      dna::parse_padded(&text[i*dna::size()], strand);
+      checksum += strand;
+    }
+  }));
+
+  std::cout << " (checksum " << checksum << ")\n";
+}
+
+/**
+ * Reference implementation of leaf canonicalisation with mirroring done one
+ * nucleotide at a time, as used before the bit-reversal implementation.
+ */
+auto mirrored_per_nucleotide(const dna& strand) -> dna {
+  auto value = std::uint64_t{0};
+  for (auto i = 0u; i < dna::size(); ++i)
+    value |= static_cast<std::uint64_t>(strand.code(dna::size() - i - 1)) << (4*i);
+  return dna{value};
+}
+
+auto canonical_per_nucleotide(const dna& strand) {
+  const auto mirror = mirrored_per_nucleotide(strand);
+  const auto is_invariant = (strand == mirror);
+  return variadic_min(
+    std::tuple{strand, false, false, is_invariant},
+    std::tuple{strand.transposed(), false, true, is_invariant},
+    std::tuple{mirror, true, false, is_invariant},
+    std::tuple{mirrored_per_nucleotide(strand.transposed()), true, true, is_invariant}
+  );
+}
+
+/**
+ * Measures the throughput of leaf canonicalisation.
+ */
+void benchmark_canonicalisation() {
+  BENCHMARK_START("Leaf canonicalisation");
+
+  constexpr auto strands = 1ul << 22;
+  const auto mask = (dna::size() == 16) ? ~0ull : (1ull << (4*dna::size())) - 1;
+  auto generator = std::mt19937_64{42};
+  auto leaves = std::vector<dna>{};
+  leaves.reserve(strands);
+  for (auto i = 0ul; i < strands; ++i) leaves.emplace_back(generator() & mask);
+
+  auto checksum = std::uint64_t{0};
+  auto report = [&](std::string_view name, double seconds) {
+    std::cout << ' ' << name << std::setw(8) << strands/seconds/1e6 << " Mleaves/s\n";
+  };
+
+  report("Per-nucleotide mirroring:  ", measure([&] {
+    for (const auto& leaf : leaves) checksum += std::get<0>(canonical_per_nucleotide(leaf));
+  }));
+
+  report("Bit-reversal mirroring:    ", measure([&] {
+    for (const auto& leaf : leaves) checksum += std::get<0>(leaf.canonical());
+  }));
+
+  auto canonicals = std::vector<dna>(strands);
+  auto transforms = std::vector<std::uint8_t>(strands);
+  report("Batched:                   ", measure([&] {
+    dna::canonical(leaves.data(), strands, canonicals.data(), transforms.data());
+  }));
+  for (const auto& leaf : canonicals) checksum += leaf;
+
+  std::cout << " (checksum " << checksum << ")\n";
+}
+
+/**
+ * Measures the latency of extracting small windows from a compressed genome,
+ * compared to indexing every strand separately.
+ */
+void benchmark_range_extraction() {
+  BENCHMARK_START("Range extraction");
+
+  auto data = read_genome("data/merged");
+  auto tree = shared_tree{data};
+  tree.sort_tree();
+  const auto nucleotides = data.size() * dna::size();
+
+  constexpr auto queries = 20000u;
+  constexpr auto window = 2000u;
+  auto generator = std::mt19937_64{42};
+  auto starts = std::vector<std::uint64_t>(queries);
+  for (auto& start : starts) start = generator() % (nucleotides - window);
+
+  auto checksum = std::uint64_t{0};
+  auto report = [&](std::string_view name, double seconds) {
+    std::cout << ' ' << name << std::setw(8) << seconds/queries*1e6 << " us/query\n";
+  };
+
+  report("operator[] per strand:     ", measure([&] {
+    for (const auto start : starts) {
+      for (auto i = start / dna::size(); i <= (start + window) / dna::size(); ++i)
+        checksum += tree[i];
+    }
+  }));
+
+  auto output = std::string(window, ' ');
+  report("extract():                 ", measure([&] {
+    for (const auto start : starts) {
+      tree.extract(start, start + window, output.data());
+      checksum += output[window/2];
+    }
+  }));
+
+  std::cout << " (checksum " << checksum << ")\n";
+}
+
+void benchmark_batch_access() {
+  BENCHMARK_START("Batch access");
+
+  auto data = read_genome("data/merged");
+  auto tree = shared_tree{data};
+  tree.sort_tree();
+
+  constexpr auto queries = 1000000u;
+  auto generator = std::mt19937_64{42};
+  auto indices = std::vector<std::uint64_t>(queries);
+  for (auto& index : indices) index = generator() % data.size();
+
+  auto checksum = std::uint64_t{0};
+  auto report = [&](std::string_view name, double seconds) {
+    std::cout << ' ' << name << std::setw(8) << seconds/queries*1e9 << " ns/query\n";
+  };
+
+  report("operator[] loop:           ", measure([&] {
+    for (const auto index : indices) checksum += tree[index];
+  }));
+
+  report("access_batch():            ", measure([&] {
+    for (const auto leaf : tree.access_batch(indices)) checksum += leaf;
+  }));
+
+  std::sort(indices.begin(), indices.end());
+  report("access_batch(), sorted:    ", measure([&] {
+    for (const auto leaf : tree.access_batch(indices)) checksum += leaf;
+  }));
+
+  std::cout << " (checksum " << checksum << ")\n";
+}
+
+void benchmark_indexed_access() {
+  BENCHMARK_START("Indexed access");
+
+  auto data = read_genome("data/merged");
+  auto tree = shared_tree{data};
+  tree.sort_tree();
+  auto temporary = std::filesystem::temp_directory_path() / "indexed_benchmark.dag";
+  tree.save_indexed(temporary);
+  auto indexed = indexed_tree{temporary};
+
+  constexpr auto queries = 1000000u;
+  auto generator = std::mt19937_64{42};
+  auto indices = std::vector<std::uint64_t>(queries);
+  for (auto& index : indices) index = generator() % data.size();
+
+  auto checksum = std::uint64_t{0};
+  auto report = [&](std::string_view name, double seconds) {
+    std::cout << ' ' << name << std::setw(8) << seconds/queries*1e9 << " ns/query\n";
+  };
+
+  std::cout << " Compact size:               " << tree.bytes() << " bytes\n";
+  std::cout << " Indexed size:               " << std::filesystem::file_size(temporary) << " bytes\n";
+  report("in-memory operator[]:      ", measure([&] {
+    for (const auto index : indices) checksum += tree[index];
+  }));
+  report("indexed operator[]:        ", measure([&] {
+    for (const auto index : indices) checksum += indexed[index];
+  }));
+
+  std::cout << " (checksum " << checksum << ")\n";
+  std::filesystem::remove(temporary);
+}
+
+void benchmark_serialization() {
+  BENCHMARK_START("Serialization");
+
+  auto data = read_genome("data/merged");
+  auto tree = shared_tree{data};
+  tree.sort_tree();
+
+  // Per-byte stream calls, as done by serializing each leaf and node on its
+  // own. The root is left out, as it is not accessible from outside the tree.
+  auto per_byte = std::stringstream{};
+  auto encode_per_byte = measure([&] {
+    per_byte = std::stringstream{};
+    binary_write(per_byte, tree.leaf_count());
+    for (auto i = 0u; i < tree.leaf_count(); ++i)
+      tree.access_leaf(pointer{i, false, false, false}).serialize(per_byte);
+    for (auto layer = 0u; layer + 1 < tree.depth(); ++layer) {
+      binary_write(per_byte, tree.node_count(layer));
+      for (auto i = 0u; i < tree.node_count(layer); ++i)
+        tree.access_node(layer, pointer{i, false, false, false}).serialize(per_byte);
+    }
+  });
+
+  auto buffered = std::stringstream{};
+  auto encode_buffered = measure([&] {
+    buffered = std::stringstream{};
+    tree.serialize(buffered);
+  });
+
+  auto decode_per_byte = measure([&] {
+    auto stream = std::stringstream{per_byte.str()};
+    auto count = std::uint64_t{0};
+    binary_read(stream, count);
+    for (auto i = 0u; i < count; ++i) dna::deserialize(stream);
+    while (binary_read(stream, count), stream) {
+      for (auto i = 0u; i < count; ++i) node::deserialize(stream);
+    }
+  });
+
+  auto decode_buffered = measure([&] {
+    auto stream = std::stringstream{buffered.str()};
+    shared_tree::deserialize(stream);
+  });
+
+  std::cout << " Serialized size:            " << buffered.str().size() << " bytes\n";
+  std::cout << " Per-byte serialize:         " << std::setw(8) << encode_per_byte*1e3 << " ms\n";
+  std::cout << " Buffered serialize:         " << std::setw(8) << encode_buffered*1e3 << " ms\n";
+  std::cout << " Per-byte deserialize:       " << std::setw(8) << decode_per_byte*1e3 << " ms\n";
+  std::cout << " Buffered deserialize:       " << std::setw(8) << decode_buffered*1e3 << " ms\n";
+}
+
+int main() {
+  benchmark_striped_map();
+  benchmark_pointer_layout();
+  benchmark_parsing();
+  benchmark_canonicalisation();
+  benchmark_range_extraction();
+  benchmark_batch_access();
+  benchmark_indexed_access();
+  benchmark_serialization();
+  return 0;
+}
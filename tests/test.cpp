@@ -2,16 +2,22 @@
  *  Unit tests for the implementation.
  */
 
+#include <algorithm>
 #include <array>
 #include <cassert>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <random>
 #include <sstream>
+#include <stdexcept>
 
 #include "shared_tree.h"
 #include "dna.h"
 #include "fasta_reader.h"
+#include "fasta_writer.h"
+#include "size_tuner.h"
 #include "utility.h"
 
 #define TEST_START(name) \
@@ -30,6 +36,25 @@
     else std::cerr << "<" << name << "> Finished, but not all tests passed\n"; \
     return errors;
 
+/**
+ * Strands of data/chmpxx together with their frequency-sorted tree, which is
+ * built on first use and shared by all tests that only read from it.
+ */
+struct genome_fixture {
+  std::vector<dna> data;
+  shared_tree tree;
+};
+
+auto chmpxx() -> const genome_fixture& {
+  static const auto fixture = [] {
+    auto data = read_genome("data/chmpxx");
+    auto tree = shared_tree{data};
+    tree.sort_tree();
+    return genome_fixture{std::move(data), std::move(tree)};
+  }();
+  return fixture;
+}
+
 auto test_dna() -> int {
   TEST_START("DNA");
 
@@ -41,6 +66,59 @@ auto test_dna() -> int {
   expects(a.transposed() == t, "A should complement T: ", a.transposed(), " != ", t);
   expects(p.mirrored() == q, "Mirroring DNA strings should be exactly reversed: ", p.mirrored(), " != ", q);
 
+  for (auto seed = 0u; seed < 64; ++seed) {
+    auto strand = dna{std::mt19937_64{seed}()};
+    auto reversed = std::string{};
+    for (auto i = 0u; i < dna::size(); ++i) reversed += strand.nucleotide(dna::size() - i - 1);
+    auto expected = dna{std::string_view{reversed}};
+    expects(strand.mirrored() == expected, "Mirroring should reverse the nucleotides: ", strand.mirrored(), " != ", expected);
+  }
+
+  { // Batched canonicalisation should match canonicalisation of single strands
+    auto strands = std::vector<dna>{};
+    auto generator = std::mt19937_64{7};
+    for (auto i = 0u; i < 64; ++i) {
+      auto strand = dna{generator() & ((1ull << (4*dna::size())) - 1)};
+      strands.emplace_back(i % 5 == 0 ? dna{std::string(dna::size(), 'A')} : strand);
+      if (i % 7 == 0) strands.back() = strands.back().mirrored();
+    }
+    auto canonicals = std::vector<dna>(strands.size());
+    auto transforms = std::vector<std::uint8_t>(strands.size());
+    dna::canonical(strands.data(), strands.size() - 3, canonicals.data(), transforms.data());
+
+    for (auto i = 0u; i < strands.size() - 3; ++i) {
+      const auto [canonical, mirror, transpose, invariant] = strands[i].canonical();
+      const auto expected = (mirror ? dna::mirror_bit : 0) | (transpose ? dna::transpose_bit : 0)
+        | (invariant ? dna::invariant_bit : 0);
+      expects(canonicals[i] == canonical, "Batched canonical strand mismatch: ", canonicals[i], " != ", canonical);
+      expects(transforms[i] == expected, "Batched transformation mismatch for ", strands[i], ": ",
+        int(transforms[i]), " != ", expected);
+    }
+  }
+
+  { // Vectorised parsing should match symbol-wise parsing
+    auto symbols = std::string{"ACGTRYKMSWBDHVN-acgtrykmswbdhvn-"};
+    for (auto i = 0u; i + 16 <= symbols.size(); ++i) {
+      auto scalar = dna{};
+      auto vectorised = dna{};
+      auto scalar_valid = dna::parse(&symbols[i], scalar);
+      auto vectorised_valid = dna::parse_padded(&symbols[i], vectorised);
+      expects(scalar_valid && vectorised_valid, "Valid symbols should parse successfully");
+      expects(scalar == vectorised, "Vectorised parsing mismatch: ", scalar, " != ", vectorised);
+    }
+
+    auto invalid = std::string{"ACGTACGTACGTACGT"};
+    auto strand = dna{};
+    invalid[dna::size()-1] = 'x';
+    expects(!dna::parse_padded(invalid.data(), strand), "Invalid symbols should be detected");
+    invalid[dna::size()-1] = '\r';
+    expects(!dna::parse_padded(invalid.data(), strand), "Carriage returns should not be taken for '-'");
+    invalid = std::string{"ACGTACGTACGTACGT"};
+    invalid[15] = 'x';
+    expects(dna::size() == 16 || dna::parse_padded(invalid.data(), strand),
+      "Symbols beyond the strand length should be ignored");
+  }
+
   TEST_END("DNA");
 }
 
@@ -55,6 +133,57 @@ auto test_pointer() -> int {
   expects(basis != mirrored, "Pointers that are not invariant under mirroring should not match when mirrored");
   expects(basis.index() == 3280, "Index conversion error: ", basis.index(), " != ", 3280);
 
+  static_assert(sizeof(pointer) == sizeof(pointer_word) && alignof(pointer) == alignof(pointer_word),
+    "Pointers should be a single word");
+  static_assert(sizeof(node) == 2*sizeof(pointer) && std::is_trivially_copyable_v<node>,
+    "Nodes should be two packed words");
+
+  const auto packed = node{pointer{5, true, false, false}, pointer{7, false, true, true}};
+  if constexpr (sizeof(pointer) == 4) {
+    auto words = std::array<std::uint32_t, 2>{};
+    std::memcpy(words.data(), &packed, sizeof(words));
+    expects(words[0] == (5u | 1u << 29), "Unexpected pointer layout: ", words[0]);
+    expects(words[1] == (7u | 1u << 30 | 1u << 31), "Unexpected pointer layout: ", words[1]);
+  }
+
+  const auto variant = node{pointer{5, true, false, false}, pointer{7, false, true, false}};
+  expects(packed == variant && packed.to_ulong() == variant.to_ulong(),
+    "Nodes should compare equal regardless of invariance bits");
+  expects(std::hash<node>()(packed) == std::hash<node>()(variant),
+    "Nodes should hash equally regardless of invariance bits");
+  expects(node{pointer{1, false, false, false}, pointer{9, false, false, false}}
+    < node{pointer{2, false, false, false}, pointer{0, false, false, false}},
+    "Nodes should be ordered on their left pointer first");
+
+  // Indices beyond the 28-bit segment are escaped to a 32-bit offset, up to
+  // the largest index a pointer holds. The escape starts at 269488142, the
+  // index of offset 0xffffffe in the last segment; index 268435454 merely
+  // equals that offset, and is stored plainly.
+  const auto indices = std::array<std::size_t, 9>{0, 15, 4111, 1052687, 268435454, 269488141,
+    269488142, 269488143, std::min<std::size_t>(pointer::null_index - 1, 4564455437)};
+  const auto sizes = std::array<std::size_t, 9>{1, 1, 2, 3, 4, 4, 8, 8, 8};
+  for (auto i = 0u; i < indices.size(); ++i) {
+    const auto original = pointer{indices[i], true, false, false};
+    auto stream = std::stringstream{};
+    original.serialize(stream);
+    expects(stream.str().size() == sizes[i] && original.bytes() == sizes[i],
+      "Unexpected size of serialized index ", indices[i], ": ", stream.str().size());
+    const auto loaded = pointer::deserialize(stream);
+    expects(loaded == original, "Serialized index ", indices[i], " loaded as ", loaded);
+  }
+  auto stream = std::stringstream{};
+  pointer{nullptr}.serialize(stream);
+  expects(stream.str().size() == 4 && pointer::deserialize(stream).empty(), "Null pointers should stay 4 bytes");
+
+  auto overflowed = false;
+  check_capacity(pointer_capacity());
+  try {
+    check_capacity(pointer_capacity() + 1);
+  } catch (const std::overflow_error&) {
+    overflowed = true;
+  }
+  expects(overflowed, "Layers beyond the pointer capacity should throw an overflow error");
+
   TEST_END("Tree pointer");
 }
 
@@ -108,6 +237,70 @@ auto test_file_reader() -> int {
     "File path: ", size, '\n',
     "Buffered read: ", i*dna::size());
 
+  { // Headers, line endings and strands spanning lines
+    auto temporary = std::filesystem::temp_directory_path() / "fasta_reader_test.fa";
+    auto sequence = std::string{};
+    for (auto j = 0u; j < 5*dna::size(); ++j) sequence += "ACGT"[(j*7) % 4];
+    {
+      auto output = std::ofstream{temporary, std::ios::binary};
+      output << ">header line\r\n";
+      for (auto j = 0u; j < sequence.size(); j += 7)
+        output << sequence.substr(j, 7) << "\r\n";
+      output << "AC\n";
+    }
+
+    auto reader = fasta_reader{temporary, 2};
+    auto parsed = std::vector<dna>{};
+    auto strands = std::vector<dna>{};
+    while (reader.read_into(strands))
+      parsed.insert(parsed.end(), strands.begin(), strands.end());
+
+    expects(parsed.size() == 5, "Headers, line endings and trailing partial strands should be skipped: ",
+      parsed.size(), " != 5");
+    for (auto j = 0u; j < parsed.size() && j < 5; ++j) {
+      auto expected = dna{std::string_view{sequence}.substr(j*dna::size(), dna::size())};
+      expects(parsed[j] == expected, "Parsed strand mismatch: ", parsed[j], " != ", expected);
+    }
+    std::filesystem::remove(temporary);
+  }
+
+  { // Empty records, lowercase symbols, N runs and a buffer holding only a header
+    auto temporary = std::filesystem::temp_directory_path() / "fasta_reader_records.fa";
+    auto sequence = std::string{};
+    for (auto j = 0u; j < 15*dna::size(); ++j) sequence += "acgt"[(j*3) % 4];
+    sequence += std::string(10*dna::size(), 'N');
+    for (auto j = 0u; j < 15*dna::size(); ++j) sequence += "ACGTn"[(j*7) % 5];
+    {
+      auto output = std::ofstream{temporary, std::ios::binary};
+      output << ">empty record\n>second record\n";
+      for (auto j = 0u; j < sequence.size(); j += 50)
+        output << sequence.substr(j, 50) << '\n';
+      output << ">trailing record without sequence\n";
+    }
+
+    constexpr auto buffer_size = 8u;
+    auto reader = fasta_reader{temporary, buffer_size};
+    auto parsed = std::vector<dna>{};
+    auto strands = std::vector<dna>{};
+    auto largest = 0ul;
+    while (reader.read_into(strands)) {
+      largest = std::max(largest, strands.size());
+      parsed.insert(parsed.end(), strands.begin(), strands.end());
+    }
+
+    expects(largest <= buffer_size, "Reads should never return more strands than the buffer holds: ",
+      largest, " > ", buffer_size);
+    expects(parsed.size() == 40, "Empty records and trailing headers should not yield strands: ",
+      parsed.size(), " != 40");
+    for (auto j = 0u; j < parsed.size() && j < 40; ++j) {
+      auto upper = sequence.substr(j*dna::size(), dna::size());
+      for (auto& symbol : upper) symbol = std::toupper(symbol);
+      const auto expected = dna{std::string_view{upper}};
+      expects(parsed[j] == expected, "Parsed strand mismatch: ", parsed[j], " != ", expected);
+    }
+    std::filesystem::remove(temporary);
+  }
+
   TEST_END("File reader");
 }
 
@@ -287,6 +480,49 @@ auto test_frequency_sort() -> int {
     ++i;
   }
 
+  const auto& [genome, tree] = chmpxx();
+  for (auto layer = 0u; layer + 1 < tree.depth(); ++layer) {
+    const auto frequencies = tree.histogram(layer);
+    expects(
+      std::is_sorted(frequencies.begin(), frequencies.end(), std::greater<>()),
+      "Layer ", layer, " should be sorted on descending frequency"
+    );
+  }
+
+  auto strands = genome;
+  auto threaded = shared_tree{strands};
+  threaded.sort_tree(false, 4);
+  auto sequential = std::stringstream{};
+  auto parallel = std::stringstream{};
+  tree.serialize(sequential);
+  threaded.serialize(parallel);
+  expects(sequential.str() == parallel.str(), "Threaded sorting should give an identical tree");
+
+  // The memory-mapped formats hold 32-bit pointers only.
+  if constexpr (sizeof(pointer) == 4) {
+    auto spilled = shared_tree{strands};
+    const auto spill = std::filesystem::temp_directory_path() / "test_sort_on_disk.dag";
+    spilled.sort_on_disk(spill);
+    auto on_disk = std::stringstream{};
+    spilled.serialize(on_disk);
+    expects(spilled.is_mapped(), "Sorting on disk should leave the tree mapped");
+    expects(sequential.str() == on_disk.str(), "Sorting on disk should give an identical tree");
+    expects(shared_tree::map(spill).bytes() == tree.bytes(), "Spilled file should hold the sorted tree");
+    spilled = shared_tree{};
+
+    // Spill a layer of many runs, buffering far less than the largest layer.
+    constexpr auto memory = std::size_t{1} << 14;
+    auto bounded = shared_tree{strands};
+    const auto peak = bounded.sort_on_disk(spill, false, memory);
+    auto bounded_sorted = std::stringstream{};
+    bounded.serialize(bounded_sorted);
+    expects(sequential.str() == bounded_sorted.str(), "Bounded sorting on disk should give an identical tree");
+    expects(peak <= memory, "Sorting on disk should buffer at most ", memory, " bytes, not ", peak);
+    expects(tree.leaf_count()*sizeof(dna) > 4*memory, "Largest layer should exceed the sorting buffer");
+    bounded = shared_tree{};
+    std::filesystem::remove(spill);
+  }
+
   TEST_END("Frequency sort");
 }
 
@@ -403,15 +639,544 @@ auto test_serialization() -> int {
     for (auto i = 0u; i < tree.width(); ++i) {
       expects(tree[i] == load[i], "Serialization and deserialization should result in identical tree: ", tree[i], " != ", load[i]);
     }
+
+    auto nulls = 0;
+    for (auto layer = 0u; layer + 1 < load.depth(); ++layer) {
+      for (auto i = 0u; i < load.node_count(layer); ++i) {
+        const auto right = load.access_node(layer, pointer{i, false, false, false}).right();
+        if (!right.empty()) continue;
+        ++nulls;
+        expects(right.is_invariant() && right.mirrored().empty() && right.inverted().empty(),
+          "Loaded null pointers should stay null when transformed");
+      }
+    }
+    expects(nulls > 0, "Trees of uneven width should contain null pointers");
+    expects(load.extract_strands(0, data.size() + 2) == data, "Extraction from a loaded tree should stop at its end");
+  }
+
+  if constexpr (sizeof(pointer) == 4) {
+    const auto& [data, tree] = chmpxx();
+    auto temporary = std::filesystem::temp_directory_path() / "mapped_test.dag";
+    tree.save_mapped(temporary);
+
+    auto mapped = shared_tree::load(temporary);
+    expects(mapped.is_mapped(), "Loading a memory-mapped file should map it");
+    expects(mapped.width() == tree.width(), "Mapped tree width mismatch: ", mapped.width(), " != ", tree.width());
+    for (auto i = 0u; i < data.size(); ++i)
+      expects(mapped[i] == data[i], "Mapped tree should be identical to the original tree at ", i);
+
+    auto copy = mapped;
+    mapped = shared_tree{};
+    auto i = 0u;
+    for (const auto strand : copy)
+      expects(strand == data[i++], "Copies of a mapped tree should keep the mapping alive");
+
+    auto stream = std::stringstream{};
+    auto original = std::stringstream{};
+    copy.serialize(stream);
+    tree.serialize(original);
+    expects(stream.str() == original.str(), "Mapped tree should serialize to the same compact format");
+
+    copy.sort_tree();
+    expects(copy[data.size()-1] == data.back(), "Modifying a mapped tree should copy it into memory");
+    std::filesystem::remove(temporary);
+  }
+
+  {
+    auto data = read_genome("data/humhbb");
+    auto tree = shared_tree{data};
+    tree.sort_tree();
+    auto sequential = std::stringstream{};
+    auto parallel = std::stringstream{};
+    tree.serialize(sequential);
+    tree.serialize(parallel, 4);
+    expects(sequential.str() == parallel.str(), "Parallel serialization should give identical output");
+
+    auto load = shared_tree::deserialize(parallel, 4);
+    auto reserialized = std::stringstream{};
+    load.serialize(reserialized);
+    expects(reserialized.str() == sequential.str(), "Parallel deserialization should give an identical tree");
+    for (auto i = 0u; i < data.size(); ++i)
+      expects(load[i] == data[i], "Parallel deserialization mismatch at ", i);
   }
 
   TEST_END("Serialization");
 }
 
+auto test_parallel_construction() -> int {
+  TEST_START("Parallel construction");
+
+  auto serialized = [](const shared_tree& tree) {
+    auto stream = std::stringstream{};
+    tree.serialize(stream);
+    return stream.str();
+  };
+
+  auto path = "data/chmpxx";
+  auto sequential = shared_tree{fasta_reader{path, 1 << 8}};
+  auto parallel = shared_tree{fasta_reader{path, 1 << 8}, false, 4};
+
+  expects(sequential.width() == parallel.width(), "Parallel construction should not alter the tree width: ",
+    sequential.width(), " != ", parallel.width());
+  expects(serialized(sequential) == serialized(parallel),
+    "Parallel construction should result in a tree identical to sequential construction");
+
+  auto data = read_genome(path);
+  auto reference = shared_tree{data};
+  auto concurrent = shared_tree{data, false, 3};
+  expects(serialized(reference) == serialized(concurrent),
+    "Parallel construction from memory should result in a tree identical to sequential construction");
+
+  auto visits = std::vector<int>(1000);
+  for (auto round = 0; round < 3; ++round)
+    parallel_for(visits.size() / 10, 4, [&](auto i) {
+      parallel_for(10, 4, [&](auto j) { ++visits[10*i + j]; });
+    });
+  expects(std::all_of(visits.begin(), visits.end(), [](auto count) { return count == 3; }),
+    "Nested parallel loops on the shared pool should visit each index once per round");
+
+  auto rethrown = false;
+  try {
+    parallel_for(8, 4, [](auto i) { if (i == 5) throw std::runtime_error{"failed"}; });
+  } catch (const std::runtime_error&) {
+    rethrown = true;
+  }
+  expects(rethrown, "An exception thrown on a pool thread should be rethrown to the caller");
+
+  auto bounded = shared_tree{fasta_reader{path, 1 << 8}, false, 1, 1};
+  auto bounded_parallel = shared_tree{fasta_reader{path, 1 << 8}, false, 4, 1};
+  expects(serialized(sequential) == serialized(bounded),
+    "Construction with spilled maps should result in an identical tree");
+  expects(serialized(sequential) == serialized(bounded_parallel),
+    "Parallel construction with spilled maps should result in an identical tree");
+
+  TEST_END("Parallel construction");
+}
+
+auto test_map_runs() -> int {
+  TEST_START("Map runs");
+
+  constexpr auto count = 1ull << 17;
+  auto map = striped_map<dna>{};
+  for (auto i = 0ull; i < count; ++i)
+    expects(map.find_or_insert(dna{i}, i).second, "Key ", i, " should be new");
+  expects(!map.is_saturated(), "A map without hits should not be saturated");
+  for (auto i = 0ull; i < count; ++i)
+    expects(!map.find_or_insert(dna{i}, 0).second, "Key ", i, " should be present");
+  expects(map.is_saturated(), "A map with only hits should be saturated");
+
+  const auto payload = map.payload_bytes();
+  map.compact();
+  expects(map.resident() == count, "Compacted entries should stay in memory");
+  expects(map.payload_bytes() < payload,
+    "Compaction should reduce payload bytes: ", map.payload_bytes(), " >= ", payload);
+
+  for (auto i = count; i < 2*count; ++i) map.find_or_insert(dna{i}, i);
+  map.spill();
+  expects(map.resident() == 0, "Spilled entries should not stay in memory");
+
+  for (auto i = 0ull; i < 2*count; ++i) {
+    const auto [index, inserted] = map.find_or_insert(dna{i}, 0);
+    expects(!inserted && index == i, "Key ", i, " should be found with index ", i, ", not ", index);
+  }
+  expects(map.find_or_insert(dna{2*count}, 2*count).second, "Key ", 2*count, " should be new");
+  expects(map.lookup_count() == 5*count + 1 && map.hit_count() == 3*count,
+    "Lookups and hits should be counted");
+
+  TEST_END("Map runs");
+}
+
+auto test_fasta_writer() -> int {
+  TEST_START("FASTA writer");
+
+  auto symbols = std::string{"ACGTRYKMSWBDHVN-"};
+  auto sequence = std::string{};
+  auto strands = std::vector<dna>{};
+  for (auto i = 0u; i < 3; ++i) {
+    std::rotate(symbols.begin(), symbols.begin() + 5, symbols.end());
+    sequence += symbols.substr(0, dna::size());
+    strands.emplace_back(std::string_view{symbols}.substr(0, dna::size()));
+  }
+
+  auto stream = std::stringstream{};
+  {
+    auto writer = fasta_writer{stream, 7, 16};
+    writer.header("sequence");
+    for (const auto& strand : strands) writer.write(strand);
+  }
+
+  auto expected = std::string{">sequence\n"};
+  for (auto i = 0u; i < sequence.size(); i += 7) expected += sequence.substr(i, 7) + '\n';
+  expects(stream.str() == expected, "FASTA output mismatch:\n", stream.str(), "\n!=\n", expected);
+
+  auto tree = shared_tree{strands};
+  stream = std::stringstream{};
+  {
+    auto writer = fasta_writer{stream, 0};
+    for (const auto strand : tree) writer.write(strand);
+  }
+  expects(stream.str() == sequence + '\n', "Decompressed tree mismatch: ", stream.str(), " != ", sequence);
+
+  auto archive = std::filesystem::temp_directory_path() / "fasta_writer_test.dag";
+  tree.save(archive);
+  expects(shared_tree::stored_dna_size(archive) == dna::size(), "DAG files should record their DNA size: ",
+    shared_tree::stored_dna_size(archive), " != ", dna::size());
+  auto loaded = shared_tree::load(archive);
+  auto decoded = std::vector<dna>{};
+  for (const auto strand : loaded) decoded.push_back(strand);
+  expects(decoded == strands, "A saved tree should load back unchanged");
+  std::filesystem::remove(archive);
+
+  TEST_END("FASTA writer");
+}
+
+auto test_range_extraction() -> int {
+  TEST_START("Range extraction");
+
+  const auto& [data, tree] = chmpxx();
+  const auto length = dna::size();
+  const auto nucleotides = data.size() * length;
+
+  auto reference = std::string(nucleotides, ' ');
+  for (auto i = 0u; i < data.size(); ++i) data[i].to_chars(&reference[i*length]);
+
+  auto generator = std::mt19937_64{3};
+  for (auto query = 0u; query < 200; ++query) {
+    const auto begin = generator() % nucleotides;
+    const auto end = std::min<std::uint64_t>(begin + generator() % 3000, nucleotides);
+    const auto extracted = tree.extract(begin, end);
+    expects(extracted == reference.substr(begin, end - begin),
+      "Extracted range [", begin, ", ", end, ") does not match the original data");
+  }
+
+  const auto tail = tree.extract(nucleotides - 5, nucleotides + 100);
+  expects(tail == reference.substr(nucleotides - 5), "Ranges should be truncated at the end of the tree");
+
+  const auto strands = tree.extract_strands(17, 4000);
+  expects(strands.size() == 4000 - 17, "Strand extraction size mismatch: ", strands.size(), " != ", 4000 - 17);
+  for (auto i = 0u; i < strands.size(); ++i)
+    expects(strands[i] == data[17 + i], "Extracted strand mismatch at ", 17 + i);
+
+  TEST_END("Range extraction");
+}
+
+auto test_batch_access() -> int {
+  TEST_START("Batch access");
+
+  const auto& [data, tree] = chmpxx();
+
+  auto generator = std::mt19937_64{5};
+  auto indices = std::vector<std::uint64_t>(5000);
+  for (auto& index : indices) index = generator() % data.size();
+  indices[1] = indices[0];
+  indices.push_back(0);
+  indices.push_back(data.size() - 1);
+
+  const auto leaves = tree.access_batch(indices);
+  expects(leaves.size() == indices.size(), "Batch size mismatch: ", leaves.size(), " != ", indices.size());
+  for (auto i = 0u; i < indices.size(); ++i)
+    expects(leaves[i] == data[indices[i]], "Batch access mismatch at index ", indices[i]);
+
+  expects(tree.access_batch({}).empty(), "Empty batch should give no leaves");
+
+  TEST_END("Batch access");
+}
+
+auto test_indexed_tree() -> int {
+  TEST_START("Indexed tree");
+  if constexpr (sizeof(pointer) != 4) {
+    TEST_END("Indexed tree");
+  }
+
+  const auto& [data, tree] = chmpxx();
+  auto temporary = std::filesystem::temp_directory_path() / "indexed_test.dag";
+  tree.save_indexed(temporary);
+
+  auto indexed = indexed_tree{temporary};
+  expects(indexed.depth() == tree.depth(), "Indexed tree depth mismatch: ", indexed.depth(), " != ", tree.depth());
+  expects(indexed.width() == tree.width(), "Indexed tree width mismatch: ", indexed.width(), " != ", tree.width());
+  for (auto i = 0u; i < data.size(); ++i)
+    expects(indexed[i] == data[i], "Indexed tree should be identical to the original tree at ", i);
+
+  auto stream = std::stringstream{};
+  auto original = std::stringstream{};
+  shared_tree::load(temporary).serialize(stream);
+  tree.serialize(original);
+  expects(stream.str() == original.str(), "Expanding an indexed tree should give the original tree");
+  std::filesystem::remove(temporary);
+
+  TEST_END("Indexed tree");
+}
+
+auto test_record_index() -> int {
+  TEST_START("Record index");
+
+  auto temporary = std::filesystem::temp_directory_path() / "record_index_test.fa";
+  auto names = std::array<std::string, 3>{"chr1", "chr2", "chrM"};
+  auto sequences = std::array<std::string, 3>{};
+  auto generator = std::mt19937_64{5};
+  for (auto i = 0u; i < sequences.size(); ++i)
+    for (auto j = 0u; j < 40*dna::size() + 7*i + 3; ++j) sequences[i] += "ACGT"[generator() % 4];
+  {
+    auto output = std::ofstream{temporary, std::ios::binary};
+    for (auto i = 0u; i < sequences.size(); ++i) {
+      output << '>' << names[i] << " sample " << i << "\r\n";
+      for (auto j = 0u; j < sequences[i].size(); j += 11) output << sequences[i].substr(j, 11) << "\r\n";
+    }
+  }
+
+  auto tree = shared_tree{fasta_reader{temporary, 4}};
+  const auto& records = tree.records();
+  auto start = std::uint64_t{0};
+  expects(records.size() == 3, "Record count mismatch: ", records.size(), " != 3");
+  for (auto i = 0u; i < records.size() && i < 3; ++i) {
+    expects(records[i].name() == names[i], "Record name mismatch: ", records[i].name(), " != ", names[i]);
+    expects(records[i].header == names[i] + " sample " + std::to_string(i), "Header mismatch: ", records[i].header);
+    expects(records[i].start == start && records[i].length == sequences[i].size(),
+      "Record ", i, " spans [", records[i].start, ", ", records[i].end(), ")");
+    expects(records.locate(start + 5) == i, "Position ", start + 5, " should lie in record ", i);
+    start += sequences[i].size();
+  }
+  expects(records.locate(start) == records.size(), "Positions past the last record should not be located");
+
+  expects(!records.resolve("chr2:1,001-1,021"), "Regions starting past the record should not resolve");
+  const auto middle = records.resolve("chr2:10-25");
+  expects(middle && tree.extract(middle->first, middle->second) == sequences[1].substr(9, 16),
+    "Region chr2:10-25 should resolve to its nucleotides");
+  const auto whole = records.resolve("chr1");
+  expects(whole && tree.extract(whole->first, whole->second) == sequences[0], "Whole records should resolve");
+  const auto clipped = records.resolve("chr1:5-100000");
+  expects(clipped && clipped->second == records[0].end(), "Regions should be clipped to their record");
+  expects(!records.resolve("chrX:1-10") && !records.resolve("chr1:0-10") && !records.resolve("chr1:9-8"),
+    "Unknown names and invalid positions should not resolve");
+
+  auto stream = std::stringstream{};
+  records.serialize(stream);
+  const auto loaded = record_index::deserialize(stream);
+  expects(loaded.size() == records.size(), "Deserialized record count mismatch");
+  for (auto i = 0u; i < loaded.size() && i < records.size(); ++i)
+    expects(loaded[i].header == records[i].header && loaded[i].start == records[i].start
+      && loaded[i].length == records[i].length, "Deserialized record ", i, " mismatch");
+  expects(loaded.find("chrM") == &loaded[2], "Deserialized records should be found by name");
+
+  auto archive = std::filesystem::temp_directory_path() / "record_index_test.dag";
+  auto same_records = [&](const record_index& stored) {
+    if (stored.size() != records.size()) return false;
+    for (auto i = 0u; i < stored.size(); ++i)
+      if (stored[i].header != records[i].header || stored[i].start != records[i].start) return false;
+    return true;
+  };
+  tree.save(archive);
+  expects(same_records(shared_tree::load(archive).records()), "Records should survive the stream format");
+  if constexpr (sizeof(pointer) == 4) {
+    tree.save_mapped(archive);
+    expects(same_records(shared_tree::map(archive).records()), "Records should survive the memory-mapped format");
+    tree.save_indexed(archive);
+    expects(same_records(indexed_tree{archive}.records()), "Records should survive the indexed format");
+    expects(same_records(indexed_tree{archive}.expand().records()), "Expanded trees should keep their records");
+  }
+  std::filesystem::remove(archive);
+  std::filesystem::remove(temporary);
+
+  TEST_END("Record index");
+}
+
+auto test_multiple_genomes() -> int {
+  TEST_START("Multiple genomes");
+
+  const auto paths = std::vector<std::filesystem::path>{"data/chmpxx", "data/edited", "data/humhbb"};
+  auto tree = shared_tree{paths};
+  tree.sort_tree();
+  expects(tree.genome_count() == paths.size(), "Genome count mismatch: ", tree.genome_count(), " != ", paths.size());
+
+  auto separate = 0ul;
+  auto references = std::vector<std::string>{};
+  for (const auto& path : paths) {
+    const auto data = read_genome(path);
+    auto& reference = references.emplace_back(data.size() * dna::size(), ' ');
+    for (auto i = 0u; i < data.size(); ++i) data[i].to_chars(&reference[i*dna::size()]);
+    separate += shared_tree{fasta_reader{path}}.node_count();
+  }
+  expects(tree.node_count() < separate, "Genomes should share nodes: ", tree.node_count(), " >= ", separate);
+
+  auto check = [&](const shared_tree& tree, const char* stage) {
+    for (auto i = 0u; i < tree.genome_count() && i < references.size(); ++i) {
+      const auto genome = tree.genome(i);
+      expects(genome.width() == references[i].size() / dna::size(), stage, " genome ", i, " has width ", genome.width());
+      expects(genome.extract(0, references[i].size() + 100) == references[i],
+        stage, " genome ", i, " does not match its input");
+    }
+  };
+  check(tree, "Constructed");
+
+  auto temporary = std::filesystem::temp_directory_path() / "multiple_genomes_test.dag";
+  tree.save(temporary);
+  const auto loaded = shared_tree::load(temporary);
+  expects(loaded.genome_count() == paths.size(), "Loaded genome count mismatch: ", loaded.genome_count());
+  check(loaded, "Loaded");
+
+  auto inputs = std::vector<std::filesystem::path>{};
+  for (auto i = 0u; i < 2; ++i) {
+    auto& input = inputs.emplace_back(std::filesystem::temp_directory_path() / ("genome_" + std::to_string(i) + ".fa"));
+    auto output = std::ofstream{input, std::ios::binary};
+    output << ">genome " << i << '\n' << references[i] << '\n';
+  }
+  shared_tree{inputs}.save(temporary);
+  const auto named = shared_tree::load(temporary);
+  for (auto i = 0u; i < inputs.size(); ++i) {
+    const auto records = named.genome(i).records();
+    expects(records.size() == 1 && records[0].header == "genome " + std::to_string(i),
+      "Genome ", i, " should keep its records in the archive");
+    std::filesystem::remove(inputs[i]);
+  }
+  std::filesystem::remove(temporary);
+
+  auto single = shared_tree{std::vector<std::filesystem::path>{paths[0]}};
+  auto plain = shared_tree{fasta_reader{paths[0]}};
+  auto first = std::stringstream{};
+  auto second = std::stringstream{};
+  single.serialize(first);
+  plain.serialize(second);
+  expects(single.genome_count() == 1 && first.str() == second.str(),
+    "A single genome should give the same tree as the plain constructor");
+
+  TEST_END("Multiple genomes");
+}
+
+auto test_append() -> int {
+  TEST_START("Append");
+
+  const auto paths = std::vector<std::filesystem::path>{"data/chmpxx", "data/edited", "data/humhbb"};
+  auto whole = shared_tree{paths};
+
+  auto tree = shared_tree{fasta_reader{paths[0]}};
+  tree.sort_tree();
+  auto stream = std::stringstream{};
+  tree.serialize(stream);
+  auto loaded = shared_tree::deserialize(stream);
+  loaded.append({paths[1], paths[2]});
+  expects(loaded.genome_count() == paths.size(), "Genome count mismatch: ", loaded.genome_count());
+  expects(loaded.leaf_count() == whole.leaf_count() && loaded.node_count() == whole.node_count(),
+    "Appending should deduplicate as well as constructing at once: ", loaded.node_count(), " != ", whole.node_count());
+
+  loaded.sort_tree();
+  for (auto i = 0u; i < paths.size() && i < loaded.genome_count(); ++i) {
+    const auto data = read_genome(paths[i]);
+    const auto strands = loaded.genome(i).extract_strands(0, data.size() + 10);
+    expects(strands == data, "Appended tree does not match genome ", i);
+  }
+
+  TEST_END("Append");
+}
+
+auto test_delta_tree() -> int {
+  TEST_START("Delta tree");
+
+  auto sorted = shared_tree{fasta_reader{"data/chmpxx"}};
+  sorted.sort_tree();
+  const auto base = std::make_shared<const shared_tree>(std::move(sorted));
+  const auto index = base_index{*base};
+  const auto data = read_genome("data/edited");
+  const auto plain = shared_tree{fasta_reader{"data/edited"}};
+
+  auto delta = shared_tree{fasta_reader{"data/edited"}, index};
+  expects(delta.is_delta() && !base->is_delta(), "Only trees built against a base should be delta trees");
+  expects(delta.leaf_count() < plain.leaf_count() && delta.node_count() < plain.node_count(),
+    "Delta trees should only hold what the input adds to the base: ", delta.node_count(), " >= ", plain.node_count());
+  const auto rebased = delta.rebase(base);
+  expects(rebased.is_rebased() && rebased.extract_strands(0, data.size() + 10) == data,
+    "Rebased delta tree does not match its input");
+  expects(rebased.access_batch({0, 100, 500}) == std::vector<dna>{data[0], data[100], data[500]},
+    "Batch access to a rebased delta tree does not match its input");
+
+  auto unsorted = shared_tree{fasta_reader{"data/merged"}};
+  const auto from_unsorted = shared_tree{fasta_reader{"data/merged"}, base_index{unsorted}};
+  unsorted.sort_tree();
+  const auto from_sorted = shared_tree{fasta_reader{"data/merged"}, base_index{unsorted}};
+  expects(from_sorted.leaf_count() == 0 && from_sorted.node_count() == 0,
+    "A delta of the base's own genome should add nothing: ", from_sorted.leaf_count(), " leaves, ", from_sorted.node_count(), " nodes");
+  expects(from_sorted.bytes() == from_unsorted.bytes(), "Sorting the base should not change the delta: ",
+    from_sorted.bytes(), " != ", from_unsorted.bytes());
+
+  const auto threaded = shared_tree{fasta_reader{"data/edited", 4}, index, false, 4};
+  auto first = std::stringstream{};
+  auto second = std::stringstream{};
+  delta.serialize(first);
+  threaded.serialize(second);
+  expects(first.str() == second.str(), "Concurrent construction should give the same delta tree");
+
+  auto temporary = std::filesystem::temp_directory_path() / "delta_tree_test.dag";
+  delta.save(temporary);
+  expects(std::filesystem::file_size(temporary) == delta.bytes(), "Size of a saved delta tree should match bytes()");
+  const auto loaded = shared_tree::load(temporary);
+  expects(loaded.is_delta(), "Loaded delta trees should remain delta trees");
+  expects(loaded.rebase(base).extract_strands(0, data.size() + 10) == data, "Loaded delta tree does not match its input");
+  std::filesystem::remove(temporary);
+
+  if constexpr (sizeof(pointer) == 4) {
+    auto archive = std::filesystem::temp_directory_path() / "delta_tree_test_base.dag";
+    base->save_mapped(archive);
+    const auto mapped = std::make_shared<const shared_tree>(shared_tree::map(archive));
+    std::filesystem::remove(base_index::path(archive));
+    const auto built = base_index{*mapped, archive};
+    const auto persisted = base_index{*mapped, archive};
+    expects(built.is_mapped() && persisted.is_mapped() && std::filesystem::exists(base_index::path(archive)),
+      "Base index should be persisted next to the base and mapped");
+    auto third = std::stringstream{};
+    shared_tree{fasta_reader{"data/edited"}, persisted}.serialize(third);
+    expects(first.str() == third.str(), "Delta tree built against a persisted index should be the same");
+    expects(delta.rebase(mapped).extract_strands(0, data.size() + 10) == data,
+      "Delta tree rebased on a mapped base does not match its input");
+    std::filesystem::remove(base_index::path(archive));
+    std::filesystem::remove(archive);
+  }
+
+  TEST_END("Delta tree");
+}
+
+auto test_size_tuner() -> int {
+  TEST_START("Size tuner");
+
+  const auto previous = dna::size();
+  const auto tuner = size_tuner{"data/chmpxx"};
+  expects(tuner.sampled() > 0, "Small inputs should be sampled as a whole");
+  const auto estimates = tuner.evaluate({4, 8, 12});
+  expects(dna::size() == previous, "Evaluation should restore the DNA size");
+
+  for (const auto& estimate : estimates) {
+    dna::size(estimate.dna_size);
+    auto tree = shared_tree{fasta_reader{"data/chmpxx"}};
+    tree.sort_tree();
+    expects(estimate.bytes == tree.bytes(), "Estimate of a whole input should be exact at size ",
+      estimate.dna_size, ": ", estimate.bytes, " != ", tree.bytes());
+  }
+  dna::size(previous);
+
+  const auto smallest = std::min_element(estimates.begin(), estimates.end(),
+    [](const auto& a, const auto& b) { return a.bytes < b.bytes; });
+  expects(size_tuner::choose(estimates).dna_size == smallest->dna_size, "Without a time weight the smallest output should be chosen");
+
+  const auto sampled = size_tuner{"data/chmpxx", 1 << 14, 4};
+  expects(sampled.sampled() > 0 && sampled.sampled() < (1 << 15), "Sample size mismatch: ", sampled.sampled());
+  const auto estimate = sampled.evaluate(8);
+  expects(estimate.bytes > 0, "Sampled inputs should give an estimate");
+
+  const auto paths = std::vector<std::filesystem::path>{"data/chmpxx", "data/humhbb"};
+  const auto both = size_tuner{paths};
+  expects(both.sampled() == tuner.sampled() + size_tuner{paths[1]}.sampled(), "All input files should be sampled");
+  const auto spread = size_tuner{paths, 1 << 14, 4};
+  expects(spread.sampled() > 0 && spread.sampled() < (1 << 15), "Sample size mismatch over several files: ", spread.sampled());
+
+  TEST_END("Size tuner");
+}
+
 int main(int argc, char* argv[]) {
   auto errors = test_dna() + test_pointer() + test_chunks()
     + test_file_reader() + test_similarity_transforms() + test_tree_transposition()
-    + test_frequency_sort() + test_tree_iteration() + test_tree_factory() + test_serialization();
+    + test_frequency_sort() + test_tree_iteration() + test_tree_factory() + test_serialization()
+    + test_parallel_construction() + test_map_runs() + test_fasta_writer() + test_range_extraction()
+    + test_batch_access() + test_indexed_tree() + test_record_index() + test_multiple_genomes()
+    + test_append() + test_delta_tree() + test_size_tuner();
   if (errors) std::cerr << "Not all tests passed\n";
   return errors;
 }
\ No newline at end of file